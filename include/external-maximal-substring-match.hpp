@@ -0,0 +1,318 @@
+#ifndef EXTERNAL_MAXIMAL_SUBSTRING_MATCH_HPP
+#define EXTERNAL_MAXIMAL_SUBSTRING_MATCH_HPP
+
+#include <unistd.h>
+
+#include "external-memory.hpp"
+#include "external-suffix-sort.hpp"
+#include "int-types.hpp"
+
+//
+// MaximalSubstringMatch::maximal_substring_matches() over suffix sort and lcp files from
+//   ExternalSuffixSort::suffix_sort_external(), for inputs whose arrays don't fit in RAM.
+//
+// Same forwards and backwards stack passes, but ss/lcp are streamed from their files, the stacks spill to
+//   disk, and each pass writes its matches to a scratch file. Both are then sorted by position and merged
+//   into msm_offsets/msm_lens in a single sequential pass - so msm_offsets/msm_lens can be (and should be)
+//   scratch file mappings.
+//
+// check_maximal_substring_matches() checks them the same way, with sorted joins instead of random access to s.
+//
+namespace ExternalMaximalSubstringMatch {
+
+  template <typename sizeN_t>
+  struct Match {
+    sizeN_t s_i;
+    sizeN_t offset;
+    sizeN_t len;
+  };
+
+  template <typename sizeN_t>
+  struct Unmatched {
+    sizeN_t s_i;
+    sizeN_t lcp;
+  };
+
+  //
+  // Visit suffixes in rank order (or reverse rank order), writing the matches found to matches_fd.
+  //
+  // next(s_i, lcp) yields the next suffix and the lcp with which to update the top-of-stack item.
+  //
+  // @return the number of matches written, via n_matches, and false on I/O error
+  //
+  template <typename sizeN_t, typename Next>
+  inline bool find_matches(sizeN_t n, Next next, int matches_fd, sizeN_t min_match_len, sizeN_t& n_matches, const char* scratch_dir) {
+    ExternalMemory::Stack<Unmatched<sizeN_t>> unmatched(scratch_dir);
+    ExternalMemory::Writer<Match<sizeN_t>> matches(matches_fd);
+
+    n_matches = 0;
+
+    for (sizeN_t k = 0; k < n; k++) {
+      sizeN_t s_i, lcp;
+      next(s_i, lcp);
+
+      // Update the match lcp of the top-of-stack item
+      if (!unmatched.empty()) {
+	unmatched.top().lcp = std::min(unmatched.top().lcp, lcp);
+      }
+
+      while (!unmatched.empty() && s_i < unmatched.top().s_i) {
+	Unmatched<sizeN_t> match = unmatched.top();
+	unmatched.pop();
+
+	// Update the match lcp of the new top-of-stack item.
+	if (!unmatched.empty()) {
+	  unmatched.top().lcp = std::min(unmatched.top().lcp, match.lcp);
+	}
+
+	// Only bother with matches of min_match_len or longer
+	if (match.lcp >= min_match_len) {
+	  matches.put(Match<sizeN_t>{match.s_i, match.s_i - s_i, match.lcp});
+	  n_matches++;
+	}
+      }
+
+      unmatched.push(Unmatched<sizeN_t>{s_i, n});
+    }
+
+    matches.flush();
+    return unmatched.ok && matches.ok;
+  }
+
+  //
+  // msm_offsets[i]/msm_lens[i] as for MaximalSubstringMatch::maximal_substring_matches(), from the n-entry
+  //   suffix sort in ss_fd and lcp in lcp_fd.
+  //
+  // @return false on I/O error
+  //
+  template <typename sizeN_t>
+  inline bool __attribute__ ((noinline)) maximal_substring_matches(int ss_fd, int lcp_fd, sizeN_t* msm_offsets, sizeN_t* msm_lens, sizeN_t n, sizeN_t min_match_len, size_t ram_budget, const char* scratch_dir) {
+    int fwd_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int bwd_fd = ExternalMemory::scratch_fd(scratch_dir);
+
+    bool ok = fwd_fd >= 0 && bwd_fd >= 0;
+
+    sizeN_t n_fwd = 0;
+    sizeN_t n_bwd = 0;
+
+    // Search forwards for matches
+    if (ok) {
+      ExternalMemory::Reader<sizeN_t> ss(ss_fd, 0, n);
+      ExternalMemory::Reader<sizeN_t> lcp(lcp_fd, 0, n);
+      // lcp[rank_i-1]
+      sizeN_t prev_lcp = n;
+
+      ok = find_matches(n, [&](sizeN_t& s_i, sizeN_t& lcp_i) {
+	  s_i = ss.get();
+	  lcp_i = prev_lcp;
+	  prev_lcp = lcp.get();
+	}, fwd_fd, min_match_len, n_fwd, scratch_dir);
+
+      ok = ok && ss.ok && lcp.ok;
+    }
+
+    // Search backwards for matches
+    if (ok) {
+      ExternalMemory::ReverseReader<sizeN_t> ss(ss_fd, n);
+      ExternalMemory::ReverseReader<sizeN_t> lcp(lcp_fd, n);
+
+      ok = find_matches(n, [&](sizeN_t& s_i, sizeN_t& lcp_i) {
+	  s_i = ss.get();
+	  lcp_i = lcp.get();
+	}, bwd_fd, min_match_len, n_bwd, scratch_dir);
+
+      ok = ok && ss.ok && lcp.ok;
+    }
+
+    auto by_s_i = [](const Match<sizeN_t>& x, const Match<sizeN_t>& y) { return x.s_i < y.s_i; };
+
+    ok = ok && ExternalMemory::sort<Match<sizeN_t>>(fwd_fd, n_fwd, fwd_fd, by_s_i, ram_budget, scratch_dir);
+    ok = ok && ExternalMemory::sort<Match<sizeN_t>>(bwd_fd, n_bwd, bwd_fd, by_s_i, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Reader<Match<sizeN_t>> fwd(fwd_fd, 0, n_fwd);
+      ExternalMemory::Reader<Match<sizeN_t>> bwd(bwd_fd, 0, n_bwd);
+
+      for (sizeN_t s_i = 0; s_i < n; s_i++) {
+	sizeN_t offset = 0;
+	sizeN_t len = 0;
+
+	if (!fwd.done() && fwd.peek().s_i == s_i) {
+	  Match<sizeN_t> match = fwd.get();
+	  offset = match.offset;
+	  len = match.len;
+	}
+
+	if (!bwd.done() && bwd.peek().s_i == s_i) {
+	  Match<sizeN_t> match = bwd.get();
+	  // Only use this match if it is longer or closer than the forwards match.
+	  if (match.len > len || (match.len == len && match.offset < offset)) {
+	    offset = match.offset;
+	    len = match.len;
+	  }
+	}
+
+	msm_offsets[s_i] = offset;
+	msm_lens[s_i] = len;
+      }
+
+      ok = fwd.ok && bwd.ok;
+    }
+
+    if (bwd_fd >= 0) {
+      close(bwd_fd);
+    }
+    if (fwd_fd >= 0) {
+      close(fwd_fd);
+    }
+
+    return ok;
+  }
+
+  //
+  // Run of matches at the same offset for check_maximal_substring_matches(), from s_i to the end of its first
+  //   match.
+  //
+  template <typename sizeN_t>
+  struct MatchRun {
+    sizeN_t s_i;
+    sizeN_t src_i;
+    sizeN_t len;
+    // Fingerprint, successively of s[0, s_i), s[s_i, s_i+len) and that plus s[0, src_i) shifted by len
+    u64 hash;
+    // s[s_i+len], or NO_BYTE at the end of s
+    u16 next;
+  };
+
+  //
+  // External version of MaximalSubstringMatch::check_maximal_substring_matches() - msm_offsets/msm_lens are
+  //   only read sequentially, and s in forward scans.
+  //
+  // Every match gets the same O(1) checks, and a match at the same offset as the match at the previous
+  //   position must be exactly one shorter. The first match of each such run is then checked by sorted joins
+  //   with s and its prefix hashes - by source end, source and match end - for s[s_i, s_i+len) and
+  //   s[src_i, src_i+len) having equal Karp-Rabin fingerprints and a mismatch (or end of string) just past.
+  //   So every run is checked - exactly, with high probability - rather than a sample.
+  //
+  // @param verified set to whether the matches passed
+  // @return false on I/O error
+  //
+  template <typename sizeN_t>
+  inline bool __attribute__ ((noinline)) check_maximal_substring_matches(const u8* s, const sizeN_t* msm_offsets, const sizeN_t* msm_lens, sizeN_t n, sizeN_t min_match_len, bool& verified, size_t ram_budget, const char* scratch_dir) {
+    using namespace ExternalSuffixSort;
+
+    verified = true;
+
+    int runs_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int hashes_fd = ExternalMemory::scratch_fd(scratch_dir);
+
+    bool ok = runs_fd >= 0 && hashes_fd >= 0;
+
+    size_t n_runs = 0;
+
+    // O(1) checks, prefix hashes - hashes[i] is the fingerprint of s[0, i) - and the runs
+    if (ok) {
+      ExternalMemory::Writer<u64> hashes(hashes_fd);
+      ExternalMemory::Writer<MatchRun<sizeN_t>> runs(runs_fd);
+      u64 hash = 0;
+
+      sizeN_t prev_offset = 0;
+      sizeN_t prev_len = 0;
+
+      for (sizeN_t s_i = 0; s_i < n; s_i++) {
+	sizeN_t msm_offset = msm_offsets[s_i];
+	sizeN_t msm_len = msm_lens[s_i];
+
+	if ((msm_offset == 0) != (msm_len == 0)) {
+	  verified = false;
+	}
+
+	if (msm_offset != 0) {
+	  if (msm_len < min_match_len || msm_offset > s_i || msm_len > n-s_i) {
+	    verified = false;
+	  } else if (msm_offset == prev_offset) {
+	    if (msm_len+1 != prev_len) {
+	      verified = false;
+	    }
+	  } else {
+	    runs.put(MatchRun<sizeN_t>{s_i, s_i - msm_offset, msm_len, hash, NO_BYTE});
+	    n_runs++;
+	  }
+	}
+
+	prev_offset = msm_offset;
+	prev_len = msm_len;
+
+	hashes.put(hash);
+	hash = hash_add(hash_mul(hash, HASH_BASE), s[s_i]);
+      }
+
+      hashes.put(hash);
+
+      hashes.flush();
+      runs.flush();
+      ok = hashes.ok && runs.ok;
+    }
+
+    // Fingerprint of the match, and the byte after it
+    ok = ok && sort_by<MatchRun<sizeN_t>>(runs_fd, n_runs, [](const MatchRun<sizeN_t>& x) { return x.s_i + x.len; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+
+      ok = ExternalMemory::filter<MatchRun<sizeN_t>>(runs_fd, n_runs, [&](MatchRun<sizeN_t>& x) {
+	  sizeN_t end = x.s_i + x.len;
+	  x.hash = hash_sub(hashes.at(end), hash_mul(x.hash, hash_pow(HASH_BASE, x.len)));
+	  x.next = end < n ? s[end] : NO_BYTE;
+	  return true;
+	});
+
+      ok = ok && hashes.ok;
+    }
+
+    // Expected fingerprint of s[0, src_i+len)
+    ok = ok && sort_by<MatchRun<sizeN_t>>(runs_fd, n_runs, [](const MatchRun<sizeN_t>& x) { return x.src_i; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+
+      ok = ExternalMemory::filter<MatchRun<sizeN_t>>(runs_fd, n_runs, [&](MatchRun<sizeN_t>& x) {
+	  x.hash = hash_add(x.hash, hash_mul(hashes.at(x.src_i), hash_pow(HASH_BASE, x.len)));
+	  return true;
+	});
+
+      ok = ok && hashes.ok;
+    }
+
+    // Check the source against it - the source ends before the match, so s[src_i+len] always exists
+    ok = ok && sort_by<MatchRun<sizeN_t>>(runs_fd, n_runs, [](const MatchRun<sizeN_t>& x) { return x.src_i + x.len; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Reader<MatchRun<sizeN_t>> runs(runs_fd, 0, n_runs);
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+
+      for (size_t k = 0; k < n_runs; k++) {
+	MatchRun<sizeN_t> x = runs.get();
+	sizeN_t end = x.src_i + x.len;
+
+	if (hashes.at(end) != x.hash || s[end] == x.next) {
+	  verified = false;
+	}
+      }
+
+      ok = runs.ok && hashes.ok;
+    }
+
+    if (hashes_fd >= 0) {
+      close(hashes_fd);
+    }
+    if (runs_fd >= 0) {
+      close(runs_fd);
+    }
+
+    return ok;
+  }
+
+} // namespace ExternalMaximalSubstringMatch
+
+#endif //def EXTERNAL_MAXIMAL_SUBSTRING_MATCH_HPP
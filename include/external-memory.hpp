@@ -0,0 +1,504 @@
+#ifndef EXTERNAL_MEMORY_HPP
+#define EXTERNAL_MEMORY_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "int-types.hpp"
+
+//
+// Building blocks for algorithms over data bigger than RAM: scratch files, sequential record streams,
+//   external merge sort and a stack that spills to disk.
+//
+// All file access is sequential (forwards, or backwards for ReverseReader and Stack, or forwards skipping
+//   unneeded blocks for Cursor) in blocks of STREAM_BUF_BYTES or more.
+//
+// I/O errors are sticky in each stream's ok flag and reported by the algorithms' bool return values.
+//
+namespace ExternalMemory {
+
+  // Buffer size of each sequential stream
+  const size_t STREAM_BUF_BYTES = 256*1024;
+
+  // Maximum number of runs merged at once by sort()
+  const size_t MERGE_FAN_IN = 64;
+
+  //
+  // @return an fd for a new empty scratch file in scratch_dir, or -1 on failure
+  //
+  // The file is unlinked immediately so it disappears when the fd is closed - or the process dies.
+  //
+  inline int scratch_fd(const char* scratch_dir) {
+    std::string path = std::string(scratch_dir) + "/pjlz-scratch.XXXXXX";
+
+    int fd = mkstemp(&path[0]);
+    if (fd >= 0) {
+      unlink(path.c_str());
+    }
+
+    return fd;
+  }
+
+  //
+  // Map a new zero-filled scratch file of n T's read/write, for n-sized arrays that needn't be resident.
+  //
+  // Must be released with unmap_scratch() with the same n.
+  //
+  // @return the mapping, or nullptr on failure
+  //
+  template <typename T>
+  inline T* map_scratch(const char* scratch_dir, size_t n) {
+    int fd = scratch_fd(scratch_dir);
+    if (fd < 0) {
+      return nullptr;
+    }
+
+    size_t len = std::max(n * sizeof(T), (size_t)1);
+
+    if (ftruncate(fd, len) != 0) {
+      close(fd);
+      return nullptr;
+    }
+
+    void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return p == MAP_FAILED ? nullptr : (T*) p;
+  }
+
+  template <typename T>
+  inline void unmap_scratch(const T* p, size_t n) {
+    if (p != nullptr) {
+      munmap((void*) p, std::max(n * sizeof(T), (size_t)1));
+    }
+  }
+
+  inline bool pread_all(int fd, void* buf, size_t len, size_t offset) {
+    u8* p = (u8*) buf;
+    while (len != 0) {
+      ssize_t n_read = pread(fd, p, len, offset);
+      if (n_read <= 0) {
+	return false;
+      }
+      p += n_read;
+      len -= n_read;
+      offset += n_read;
+    }
+    return true;
+  }
+
+  //
+  // Free the disk space of bytes [offset, offset+len) of fd, which then read back as zeros - best effort,
+  //   for scratch data that has been consumed.
+  //
+  inline void discard_range(int fd, size_t offset, size_t len) {
+    (void) fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+  }
+
+  inline bool pwrite_all(int fd, const void* buf, size_t len, size_t offset) {
+    const u8* p = (const u8*) buf;
+    while (len != 0) {
+      ssize_t n_written = pwrite(fd, p, len, offset);
+      if (n_written <= 0) {
+	return false;
+      }
+      p += n_written;
+      len -= n_written;
+      offset += n_written;
+    }
+    return true;
+  }
+
+  inline size_t stream_buf_len(size_t record_size) {
+    return std::max(STREAM_BUF_BYTES / record_size, (size_t)1);
+  }
+
+  //
+  // Sequential writer of T records to fd, starting at record index begin.
+  //
+  template <typename T>
+  struct Writer {
+    const int fd;
+    size_t pos;
+    std::vector<T> buf;
+    bool ok;
+
+    Writer(int fd, size_t begin = 0, size_t buf_len = stream_buf_len(sizeof(T))) :
+      fd(fd),
+      pos(begin),
+      ok(true)
+    {
+      buf.reserve(buf_len);
+    }
+
+    ~Writer() {
+      flush();
+    }
+
+    void flush() {
+      if (buf.size() != 0) {
+	ok = pwrite_all(fd, buf.data(), buf.size() * sizeof(T), pos * sizeof(T)) && ok;
+	pos += buf.size();
+	buf.clear();
+      }
+    }
+
+    void put(const T& v) {
+      buf.push_back(v);
+      if (buf.size() == buf.capacity()) {
+	flush();
+      }
+    }
+  };
+
+  //
+  // Sequential reader of the T records [begin, end) of fd.
+  //
+  // With discard_consumed set, the disk space of each block is freed once it has been read.
+  //
+  template <typename T>
+  struct Reader {
+    const int fd;
+    size_t pos;
+    const size_t end;
+    const bool discard_consumed;
+    std::vector<T> buf;
+    size_t buf_i;
+    bool ok;
+
+    Reader(int fd, size_t begin, size_t end, size_t buf_len = stream_buf_len(sizeof(T)), bool discard_consumed = false) :
+      fd(fd),
+      pos(begin),
+      end(end),
+      discard_consumed(discard_consumed),
+      buf_i(0),
+      ok(true)
+    {
+      buf.reserve(buf_len);
+      fill();
+    }
+
+    void fill() {
+      if (discard_consumed && buf.size() != 0) {
+	discard_range(fd, (pos - buf.size()) * sizeof(T), buf.size() * sizeof(T));
+      }
+
+      size_t len = std::min(buf.capacity(), end - pos);
+      buf.resize(len);
+      buf_i = 0;
+      if (len != 0) {
+	ok = pread_all(fd, buf.data(), len * sizeof(T), pos * sizeof(T)) && ok;
+	pos += len;
+      }
+    }
+
+    bool done() const {
+      return buf_i == buf.size();
+    }
+
+    // Next record - only valid if !done()
+    const T& peek() const {
+      return buf[buf_i];
+    }
+
+    T get() {
+      T v = buf[buf_i++];
+      if (buf_i == buf.size()) {
+	fill();
+      }
+      return v;
+    }
+  };
+
+  //
+  // Reader of the T records [0, end) of fd from last to first.
+  //
+  template <typename T>
+  struct ReverseReader {
+    const int fd;
+    size_t pos;
+    std::vector<T> buf;
+    size_t buf_i;
+    bool ok;
+
+    ReverseReader(int fd, size_t end, size_t buf_len = stream_buf_len(sizeof(T))) :
+      fd(fd),
+      pos(end),
+      buf_i(0),
+      ok(true)
+    {
+      buf.reserve(buf_len);
+      fill();
+    }
+
+    void fill() {
+      size_t len = std::min(buf.capacity(), pos);
+      buf.resize(len);
+      pos -= len;
+      buf_i = len;
+      if (len != 0) {
+	ok = pread_all(fd, buf.data(), len * sizeof(T), pos * sizeof(T)) && ok;
+      }
+    }
+
+    bool done() const {
+      return buf_i == 0;
+    }
+
+    T get() {
+      T v = buf[--buf_i];
+      if (buf_i == 0) {
+	fill();
+      }
+      return v;
+    }
+  };
+
+  //
+  // Forward-only lookups in the n T records of fd at increasing - not necessarily adjacent - indexes.
+  //
+  // Whole blocks are read, so dense lookups are sequential I/O and sparse ones skip ahead. If writable,
+  //   records returned by at() may be modified and are written back when the cursor moves past them.
+  //
+  template <typename T>
+  struct Cursor {
+    const int fd;
+    const size_t n;
+    const bool writable;
+    std::vector<T> buf;
+    // Index of buf[0] in fd
+    size_t begin;
+    // Whether buf is to be written back
+    bool dirty;
+    bool ok;
+
+    Cursor(int fd, size_t n, bool writable = false, size_t buf_len = stream_buf_len(sizeof(T))) :
+      fd(fd),
+      n(n),
+      writable(writable),
+      begin(0),
+      dirty(false),
+      ok(true)
+    {
+      buf.reserve(buf_len);
+    }
+
+    ~Cursor() {
+      flush();
+    }
+
+    void flush() {
+      if (dirty) {
+	ok = pwrite_all(fd, buf.data(), buf.size() * sizeof(T), begin * sizeof(T)) && ok;
+	dirty = false;
+      }
+    }
+
+    // Record i - only valid for i < n and no less than the previous i
+    T& at(size_t i) {
+      if (i >= begin + buf.size()) {
+	flush();
+	begin = i;
+	buf.resize(std::min(buf.capacity(), n - i));
+	ok = pread_all(fd, buf.data(), buf.size() * sizeof(T), begin * sizeof(T)) && ok;
+      }
+      dirty = dirty || writable;
+      return buf[i - begin];
+    }
+  };
+
+  //
+  // Rewrite the n T records of fd in place, keeping only those for which f(x) - which may modify x - is true.
+  //
+  // @return false on I/O error; n is updated to the number of records kept
+  //
+  template <typename T, typename F>
+  inline bool filter(int fd, size_t& n, F f) {
+    Reader<T> in(fd, 0, n);
+    // Writes trail the (buffered) reads, so in place is safe
+    Writer<T> out(fd);
+    size_t n_kept = 0;
+
+    for (size_t k = 0; k < n; k++) {
+      T x = in.get();
+      if (f(x)) {
+	out.put(x);
+	n_kept++;
+      }
+    }
+
+    out.flush();
+    n = n_kept;
+    return in.ok && out.ok;
+  }
+
+  //
+  // Sort the n T records of in_fd into out_fd (which may be the same fd) by less.
+  //
+  // Runs of ram_budget bytes are sorted in RAM then merged MERGE_FAN_IN at a time, ping-ponging through
+  //   scratch files, so RAM use is about ram_budget and all I/O is sequential. Runs - and the input, if
+  //   sorting in place - are discarded as they are consumed, so little more disk space than the records
+  //   themselves is needed.
+  //
+  // @return false on I/O error
+  //
+  template <typename T, typename Less>
+  inline bool __attribute__ ((noinline)) sort(int in_fd, size_t n, int out_fd, Less less, size_t ram_budget, const char* scratch_dir) {
+    size_t run_len = std::max(ram_budget / sizeof(T), (size_t)1);
+    size_t n_runs = (n + run_len-1) / run_len;
+
+    bool ok = true;
+
+    // Run formation - straight into out_fd if it's all one run
+    int runs_fd = n_runs <= 1 ? out_fd : scratch_fd(scratch_dir);
+    if (runs_fd < 0) {
+      return false;
+    }
+
+    {
+      std::vector<T> run;
+      run.reserve(std::min(run_len, n));
+
+      for (size_t run_begin = 0; run_begin < n; run_begin += run_len) {
+	size_t len = std::min(run_len, n - run_begin);
+	run.resize(len);
+	ok = pread_all(in_fd, run.data(), len * sizeof(T), run_begin * sizeof(T)) && ok;
+	// Sorting in place - the input is about to be overwritten anyway, so free its space as the runs take it
+	if (in_fd == out_fd && runs_fd != out_fd) {
+	  discard_range(in_fd, run_begin * sizeof(T), len * sizeof(T));
+	}
+	std::sort(run.begin(), run.end(), less);
+	ok = pwrite_all(runs_fd, run.data(), len * sizeof(T), run_begin * sizeof(T)) && ok;
+      }
+    }
+
+    // Merge passes
+    size_t merge_buf_len = std::max(ram_budget / sizeof(T) / (MERGE_FAN_IN+1), (size_t)1);
+
+    while (ok && n_runs > 1) {
+      size_t merged_run_len = run_len * MERGE_FAN_IN;
+      size_t n_merged_runs = (n_runs + MERGE_FAN_IN-1) / MERGE_FAN_IN;
+
+      int merged_fd = n_merged_runs == 1 ? out_fd : scratch_fd(scratch_dir);
+      if (merged_fd < 0) {
+	ok = false;
+	break;
+      }
+
+      for (size_t merged_begin = 0; merged_begin < n; merged_begin += merged_run_len) {
+	std::vector<Reader<T>*> readers;
+	for (size_t run_begin = merged_begin; run_begin < std::min(merged_begin + merged_run_len, n); run_begin += run_len) {
+	  // Runs are always scratch here, so their space is freed as they are merged
+	  readers.push_back(new Reader<T>(runs_fd, run_begin, std::min(run_begin + run_len, n), merge_buf_len, /*discard_consumed*/true));
+	}
+
+	Writer<T> out(merged_fd, merged_begin, merge_buf_len);
+
+	// Min-heap of the readers by head record
+	auto greater_head = [&less](const Reader<T>* r1, const Reader<T>* r2) { return less(r2->peek(), r1->peek()); };
+	std::vector<Reader<T>*> heap(readers);
+	std::make_heap(heap.begin(), heap.end(), greater_head);
+
+	while (!heap.empty()) {
+	  std::pop_heap(heap.begin(), heap.end(), greater_head);
+	  Reader<T>* least = heap.back();
+	  out.put(least->get());
+	  if (least->done()) {
+	    heap.pop_back();
+	  } else {
+	    std::push_heap(heap.begin(), heap.end(), greater_head);
+	  }
+	}
+
+	out.flush();
+	ok = ok && out.ok;
+
+	for (Reader<T>* reader : readers) {
+	  ok = ok && reader->ok;
+	  delete reader;
+	}
+      }
+
+      if (runs_fd != in_fd && runs_fd != out_fd) {
+	close(runs_fd);
+      }
+
+      runs_fd = merged_fd;
+      run_len = merged_run_len;
+      n_runs = n_merged_runs;
+    }
+
+    if (runs_fd != out_fd && runs_fd != in_fd) {
+      close(runs_fd);
+    }
+
+    return ok;
+  }
+
+  //
+  // Stack of T that keeps at most 2*block_len entries in RAM and spills the rest to a scratch file.
+  //
+  template <typename T>
+  struct Stack {
+    const int fd;
+    const size_t block_len;
+    // In-RAM top of the stack
+    std::vector<T> top_entries;
+    // Number of entries spilled to fd, below top_entries
+    size_t n_spilled;
+    bool ok;
+
+    Stack(const char* scratch_dir, size_t block_len = stream_buf_len(sizeof(T))) :
+      fd(scratch_fd(scratch_dir)),
+      block_len(block_len),
+      n_spilled(0),
+      ok(fd >= 0)
+    {
+      top_entries.reserve(2*block_len);
+    }
+
+    ~Stack() {
+      if (fd >= 0) {
+	close(fd);
+      }
+    }
+
+    bool empty() const {
+      return top_entries.empty() && n_spilled == 0;
+    }
+
+    void push(const T& v) {
+      if (top_entries.size() == 2*block_len) {
+	ok = ok && pwrite_all(fd, top_entries.data(), block_len * sizeof(T), n_spilled * sizeof(T));
+	n_spilled += block_len;
+	top_entries.erase(top_entries.begin(), top_entries.begin() + block_len);
+      }
+      top_entries.push_back(v);
+    }
+
+    // Top entry - only valid if !empty()
+    T& top() {
+      if (top_entries.empty()) {
+	n_spilled -= block_len;
+	top_entries.resize(block_len);
+	ok = ok && pread_all(fd, top_entries.data(), block_len * sizeof(T), n_spilled * sizeof(T));
+      }
+      return top_entries.back();
+    }
+
+    void pop() {
+      top();
+      top_entries.pop_back();
+    }
+  };
+
+} // namespace ExternalMemory
+
+#endif //def EXTERNAL_MEMORY_HPP
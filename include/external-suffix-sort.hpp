@@ -0,0 +1,753 @@
+#ifndef EXTERNAL_SUFFIX_SORT_HPP
+#define EXTERNAL_SUFFIX_SORT_HPP
+
+#include <unistd.h>
+
+#include "external-memory.hpp"
+#include "int-types.hpp"
+
+//
+// Suffix sort and lcp for inputs whose suffix/lcp arrays don't fit in RAM.
+//
+// The suffix sort is by prefix doubling with discarding (Dementiev et al.). Each suffix is named by the
+//   rank of its first h bytes - initially h = 8, straight from the input - and names for 2h bytes are
+//   the ranks of (name[i], name[i+h]) pairs, found by sorting (name[i], name[i+h], i) tuples. Suffixes
+//   whose names are already unique are final and drop out - each round only sorts the suffixes still in
+//   a group of equal names, patching their new names into the single string-order names file. Doubling
+//   stops when no such suffixes remain, and the names are then the suffix ranks.
+//
+// The lcp is computed in string order, as the permuted lcp PLCP[b] = lcp(b, a) where a = Φ[b] is the
+//   suffix just before b in the suffix sort (Kärkkäinen et al.). Where s[a-1] == s[b-1] and Φ[b-1] is
+//   a-1, PLCP[b] is exactly PLCP[b-1] - 1. The remaining - irreducible - pairs are matched by sorted joins
+//   of the pairs with s by a then by b: comparing 8-byte windows settles every lcp under 8, and the rest
+//   gallop then binary search over Karp-Rabin fingerprints of s, each round's lookups batched into sorted
+//   joins against the prefix hash file, before a last window comparison finds the exact mismatch. The
+//   reducible pairs then fall out of a single merge pass in string order.
+//
+// Everything is external merge sorts and forward scans of s and scratch files - skipping ahead over blocks
+//   that are not needed - so RAM use is about ram_budget plus stream buffers, with no random I/O. Cost is
+//   O(sort(N) log LCP) I/O for the longest lcp LCP - suffixes drop out of the doubling as soon as they are
+//   distinguished, and only irreducible pairs with lcps of 8 or more ever need more than two joins - so
+//   inputs with long repeats still cost log LCP rounds over the suffixes inside them.
+//
+// Scratch space is linear: the suffix sort, lcp and 8-byte-per-position prefix hash files plus, at peak,
+//   the 56-byte lcp query per adjacent pair - sorts discard their input as it is consumed, and all other
+//   scratch files are released as soon as they are finished with. With 64-bit sizeN_t that is about 75
+//   bytes per input byte, measured at up to 100 (400MB for 4MB of text repeated 4 times, 1.6GB for 16MB
+//   of base64) - so scratch_dir needs about 100 times the input size free.
+//
+// The result is verified along the way, without trusting the names: the suffix sort must be a permutation,
+//   each irreducible adjacent pair must differ in the right order just past its lcp with the bytes before
+//   it matching - by Karp-Rabin fingerprint, so exact with high probability - and each reducible pair
+//   follows exactly from its predecessor in string order.
+//
+// s itself is expected to be a (read-only) mmap of the input, which is only read in forward scans.
+//
+namespace ExternalSuffixSort {
+
+  // Bytes in the initial names
+  const size_t INITIAL_H = 8;
+
+  //
+  // Up to 8 bytes of s at i, big-endian so that integer order is string order, zero padded beyond n.
+  //
+  template <typename sizeN_t>
+  inline u64 window(const u8* s, sizeN_t n, sizeN_t i) {
+    u64 w = 0;
+    for (sizeN_t k = 0; k < INITIAL_H; k++) {
+      w = (w << 8) | (i+k < n ? s[i+k] : 0);
+    }
+    return w;
+  }
+
+  // Number of real bytes in window(s, n, i) - shorter sorts first among equal windows.
+  template <typename sizeN_t>
+  inline sizeN_t window_len(sizeN_t n, sizeN_t i) {
+    return n-i < INITIAL_H ? n-i : INITIAL_H;
+  }
+
+  // Karp-Rabin fingerprints are polynomials in HASH_BASE mod HASH_PRIME
+  const u64 HASH_PRIME = (1ULL << 61) - 1;
+  const u64 HASH_BASE = 0x1b873593cc9e2d51ULL % HASH_PRIME;
+
+  inline u64 hash_reduce(u64 x) {
+    x = (x & HASH_PRIME) + (x >> 61);
+    return x >= HASH_PRIME ? x - HASH_PRIME : x;
+  }
+
+  inline u64 hash_mul(u64 x, u64 y) {
+    unsigned __int128 xy = (unsigned __int128)x * y;
+    return hash_reduce(hash_reduce((u64)(xy & HASH_PRIME) + (u64)(xy >> 61)));
+  }
+
+  inline u64 hash_add(u64 x, u64 y) {
+    return hash_reduce(x + y);
+  }
+
+  inline u64 hash_sub(u64 x, u64 y) {
+    return hash_reduce(x + HASH_PRIME - y);
+  }
+
+  inline u64 hash_pow(u64 x, u64 e) {
+    u64 x_e = 1;
+    for (; e != 0; e >>= 1) {
+      if (e & 1) {
+	x_e = hash_mul(x_e, x);
+      }
+      x = hash_mul(x, x);
+    }
+    return x_e;
+  }
+
+  template <typename sizeN_t>
+  struct WindowedSuffix {
+    u64 window;
+    sizeN_t window_len;
+    sizeN_t i;
+  };
+
+  template <typename sizeN_t>
+  struct PairedSuffix {
+    sizeN_t name1;
+    // name[i+h] + 1, or 0 if i+h is past the end
+    sizeN_t name2;
+    sizeN_t i;
+  };
+
+  template <typename sizeN_t>
+  struct NamedSuffix {
+    sizeN_t name;
+    sizeN_t i;
+  };
+
+  template <typename sizeN_t>
+  struct RenamedSuffix {
+    sizeN_t name;
+    sizeN_t i;
+    // Whether no other suffix has this name - the suffix is then final
+    bool unique;
+  };
+
+  //
+  // Adjacent suffixes a and b = ss[r] and ss[r+1].
+  //
+  template <typename sizeN_t>
+  struct AdjacentSuffixes {
+    sizeN_t a;
+    sizeN_t b;
+    sizeN_t r;
+  };
+
+  //
+  // lcp query for the adjacent suffixes a and b = ss[r] and ss[r+1] - acc bytes are known to match so far.
+  //
+  template <typename sizeN_t>
+  struct LcpQuery {
+    sizeN_t a;
+    sizeN_t b;
+    sizeN_t r;
+    sizeN_t acc;
+    // Fingerprint difference of s[0, a+acc) and s[0, b+acc) - the suffixes match for another k bytes iff
+    //   the difference at acc+k is this times HASH_BASE^k.
+    u64 hash;
+    // Value looked up at a's side, pending the lookup at b's side
+    u64 a_value;
+    // s[a-1], or NO_BYTE if a is 0 - for the reducibility test
+    u16 a_prev;
+    // Galloping (ascending) or binary search (descending) step is 1 << log_step - the query is done when the
+    //   step drops below INITIAL_H.
+    u8 log_step;
+    bool ascending;
+  };
+
+  // Not a byte - for s[-1]
+  const u16 NO_BYTE = 256;
+
+  //
+  // PLCP[b] = lcp[r] in string order.
+  //
+  template <typename sizeN_t>
+  struct PermutedLcp {
+    // PLCP[b] is PLCP[b-1] - 1
+    static const sizeN_t REDUCED = ~(sizeN_t)0;
+
+    sizeN_t b;
+    sizeN_t r;
+    sizeN_t lcp;
+  };
+
+  //
+  // Sort the n T records of fd in place by key(x).
+  //
+  template <typename T, typename Key>
+  inline bool sort_by(int fd, size_t n, Key key, size_t ram_budget, const char* scratch_dir) {
+    return ExternalMemory::sort<T>(fd, n, fd, [&key](const T& x, const T& y) { return key(x) < key(y); }, ram_budget, scratch_dir);
+  }
+
+  //
+  // Scan sorted suffixes, renaming each as base(x) plus the index within its old group - the suffixes with
+  //   equal base(x) - of the first suffix with an equal key. Names are thus the ranks of the suffixes by key.
+  //
+  // Renamed suffixes go to renamed_fd.
+  //
+  template <typename sizeN_t, typename T, typename Base, typename Equal>
+  inline bool rename_sorted(int sorted_fd, size_t n_sorted, int renamed_fd, Base base, Equal equal) {
+    ExternalMemory::Reader<T> in(sorted_fd, 0, n_sorted, ExternalMemory::stream_buf_len(sizeof(T)), /*discard_consumed*/true);
+    ExternalMemory::Writer<RenamedSuffix<sizeN_t>> renamed(renamed_fd);
+
+    sizeN_t offset = 0;
+    sizeN_t name = 0;
+    T prev = T();
+
+    for (size_t k = 0; k < n_sorted; k++) {
+      T curr = in.get();
+
+      bool new_group = k == 0 || base(prev) != base(curr);
+      offset = new_group ? 0 : offset+1;
+
+      bool new_name = new_group || !equal(prev, curr);
+      if (new_name) {
+	name = base(curr) + offset;
+      }
+
+      bool unique = new_name && (in.done() || !equal(curr, in.peek()));
+
+      renamed.put(RenamedSuffix<sizeN_t>{name, curr.i, unique});
+      prev = curr;
+    }
+
+    renamed.flush();
+    return in.ok && renamed.ok;
+  }
+
+  //
+  // Sort renamed suffixes back into string order, patch their names into names_fd, and write the suffixes
+  //   that are not yet unique to active_fd - in string order.
+  //
+  // Initially every suffix is renamed, so names_fd is just written out in full.
+  //
+  template <typename sizeN_t>
+  inline bool apply_renames(int renamed_fd, size_t n_renamed, int names_fd, sizeN_t n, int active_fd, size_t& n_active, bool initial, size_t ram_budget, const char* scratch_dir) {
+    if (!sort_by<RenamedSuffix<sizeN_t>>(renamed_fd, n_renamed, [](const RenamedSuffix<sizeN_t>& x) { return x.i; }, ram_budget, scratch_dir)) {
+      return false;
+    }
+
+    ExternalMemory::Reader<RenamedSuffix<sizeN_t>> in(renamed_fd, 0, n_renamed, ExternalMemory::stream_buf_len(sizeof(RenamedSuffix<sizeN_t>)), /*discard_consumed*/true);
+    ExternalMemory::Writer<sizeN_t> all_names(names_fd);
+    ExternalMemory::Cursor<sizeN_t> names(names_fd, n, /*writable*/!initial);
+    ExternalMemory::Writer<sizeN_t> active(active_fd);
+
+    n_active = 0;
+
+    for (size_t k = 0; k < n_renamed; k++) {
+      RenamedSuffix<sizeN_t> x = in.get();
+
+      if (initial) {
+	all_names.put(x.name);
+      } else {
+	names.at(x.i) = x.name;
+      }
+
+      if (!x.unique) {
+	active.put(x.i);
+	n_active++;
+      }
+    }
+
+    all_names.flush();
+    names.flush();
+    active.flush();
+
+    return in.ok && all_names.ok && names.ok && active.ok;
+  }
+
+  //
+  // Compare q's window w of s at b+acc with its window at a+acc, adding the bytes that match to acc.
+  //
+  // Verification - the windows must differ in the right order (or a must end first) just past the lcp.
+  //
+  // @return whether the windows match in full, so the suffixes may match further
+  //
+  template <typename sizeN_t>
+  inline bool compare_windows(LcpQuery<sizeN_t>& q, u64 w, sizeN_t n, bool& verified) {
+    sizeN_t a_len = window_len(n, q.a + q.acc);
+    sizeN_t b_len = window_len(n, q.b + q.acc);
+    u64 diff = w ^ q.a_value;
+    sizeN_t common = diff == 0 ? INITIAL_H : __builtin_clzll(diff) / 8;
+
+    if (common < std::min(a_len, b_len)) {
+      // Mismatch - in order iff a's byte is less, which is the case iff a's window is less
+      if (q.a_value > w) {
+	verified = false;
+      }
+    } else if (a_len == INITIAL_H && b_len == INITIAL_H) {
+      return true;
+    } else {
+      // The shorter suffix sorts first when one is a prefix of the other
+      if (a_len >= b_len) {
+	verified = false;
+      }
+      common = std::min(a_len, b_len);
+    }
+
+    q.acc += common;
+    return false;
+  }
+
+  //
+  // Start queries from the adjacent suffixes in adjacent_fd - joined with s and the prefix hashes sorted by a
+  //   then by b - checking on the way that the suffixes in the suffix sort are distinct and in range.
+  //
+  // Queries that are reducible, or that are finished by their first INITIAL_H bytes, go to plcp_fd in string
+  //   order. The rest are left in q_fd, with their fingerprint differences, for galloping.
+  //
+  template <typename sizeN_t>
+  inline bool start_queries(const u8* s, sizeN_t n, int adjacent_fd, int q_fd, size_t& n_q, int hashes_fd, int plcp_fd, size_t& n_plcp, bool& verified, size_t ram_budget, const char* scratch_dir) {
+    bool ok = sort_by<AdjacentSuffixes<sizeN_t>>(adjacent_fd, n_q, [](const AdjacentSuffixes<sizeN_t>& x) { return x.a; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      // adjacent_fd is finished with as it is read
+      ExternalMemory::Reader<AdjacentSuffixes<sizeN_t>> in(adjacent_fd, 0, n_q, ExternalMemory::stream_buf_len(sizeof(AdjacentSuffixes<sizeN_t>)), /*discard_consumed*/true);
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+      ExternalMemory::Writer<LcpQuery<sizeN_t>> out(q_fd);
+      sizeN_t prev_a = 0;
+
+      for (size_t k = 0; k < n_q; k++) {
+	AdjacentSuffixes<sizeN_t> x = in.get();
+	LcpQuery<sizeN_t> q = LcpQuery<sizeN_t>{x.a, x.b, x.r, 0, 0, 0, NO_BYTE, 0, false};
+
+	if (x.a >= n || (k != 0 && x.a <= prev_a)) {
+	  verified = false;
+	} else {
+	  q.hash = hashes.at(x.a);
+	  q.a_value = window(s, n, x.a);
+	  q.a_prev = x.a > 0 ? s[x.a-1] : NO_BYTE;
+	}
+	prev_a = x.a;
+
+	out.put(q);
+      }
+
+      out.flush();
+      ok = in.ok && hashes.ok && out.ok;
+    }
+
+    ok = ok && sort_by<LcpQuery<sizeN_t>>(q_fd, n_q, [](const LcpQuery<sizeN_t>& q) { return q.b; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+      ExternalMemory::Writer<PermutedLcp<sizeN_t>> plcp(plcp_fd);
+      bool first = true;
+      LcpQuery<sizeN_t> prev = LcpQuery<sizeN_t>();
+
+      n_plcp = 0;
+
+      ok = ExternalMemory::filter<LcpQuery<sizeN_t>>(q_fd, n_q, [&](LcpQuery<sizeN_t>& q) {
+	  bool valid = q.a < n && q.b < n && (first || q.b > prev.b);
+	  bool reducible = !first && prev.b == q.b-1 && prev.a+1 == q.a && q.a_prev == s[q.b-1];
+	  first = false;
+	  prev = q;
+
+	  if (!valid) {
+	    verified = false;
+	    plcp.put(PermutedLcp<sizeN_t>{q.b, q.r, 0});
+	  } else if (reducible) {
+	    plcp.put(PermutedLcp<sizeN_t>{q.b, q.r, PermutedLcp<sizeN_t>::REDUCED});
+	  } else if (compare_windows(q, window(s, n, q.b), n, verified)) {
+	    q.hash = hash_sub(q.hash, hashes.at(q.b));
+	    q.log_step = __builtin_ctzll(INITIAL_H);
+	    q.ascending = true;
+	    return true;
+	  } else {
+	    plcp.put(PermutedLcp<sizeN_t>{q.b, q.r, q.acc});
+	  }
+
+	  n_plcp++;
+	  return false;
+	});
+
+      plcp.flush();
+      ok = ok && hashes.ok && plcp.ok && ftruncate(q_fd, n_q * sizeof(LcpQuery<sizeN_t>)) == 0;
+    }
+
+    return ok;
+  }
+
+  //
+  // One galloping/binary search round - where s[a+acc, a+acc+step) == s[b+acc, b+acc+step) by fingerprint,
+  //   add step to acc. Queries whose step drops below INITIAL_H are done and move to done_fd.
+  //
+  template <typename sizeN_t>
+  inline bool step_queries(sizeN_t n, int q_fd, size_t& n_q, int hashes_fd, int done_fd, size_t& n_done, size_t ram_budget, const char* scratch_dir) {
+    // Not a hash - for positions past the end
+    const u64 NO_HASH = ~0ULL;
+
+    bool ok = sort_by<LcpQuery<sizeN_t>>(q_fd, n_q, [](const LcpQuery<sizeN_t>& q) { return q.a + q.acc + ((sizeN_t)1 << q.log_step); }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+
+      ok = ExternalMemory::filter<LcpQuery<sizeN_t>>(q_fd, n_q, [&](LcpQuery<sizeN_t>& q) {
+	  sizeN_t pos = q.a + q.acc + ((sizeN_t)1 << q.log_step);
+	  q.a_value = pos <= n ? hashes.at(pos) : NO_HASH;
+	  return true;
+	});
+
+      ok = ok && hashes.ok;
+    }
+
+    ok = ok && sort_by<LcpQuery<sizeN_t>>(q_fd, n_q, [](const LcpQuery<sizeN_t>& q) { return q.b + q.acc + ((sizeN_t)1 << q.log_step); }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Cursor<u64> hashes(hashes_fd, (size_t)n+1);
+      ExternalMemory::Writer<LcpQuery<sizeN_t>> done(done_fd, n_done);
+
+      ok = ExternalMemory::filter<LcpQuery<sizeN_t>>(q_fd, n_q, [&](LcpQuery<sizeN_t>& q) {
+	  sizeN_t step = (sizeN_t)1 << q.log_step;
+	  sizeN_t pos = q.b + q.acc + step;
+	  bool match = false;
+
+	  if (q.a_value != NO_HASH && pos <= n) {
+	    u64 hash = hash_sub(q.a_value, hashes.at(pos));
+	    match = hash == hash_mul(q.hash, hash_pow(HASH_BASE, step));
+	    if (match) {
+	      q.acc += step;
+	      q.hash = hash;
+	    }
+	  }
+
+	  if (match && q.ascending) {
+	    q.log_step++;
+	  } else {
+	    q.ascending = false;
+	    q.log_step--;
+	  }
+
+	  if (((sizeN_t)1 << q.log_step) < INITIAL_H) {
+	    done.put(q);
+	    n_done++;
+	    return false;
+	  }
+	  return true;
+	});
+
+      done.flush();
+      ok = ok && hashes.ok && done.ok;
+    }
+
+    return ok;
+  }
+
+  //
+  // Last step of the galloped queries - less than INITIAL_H bytes remain to match, so compare windows of s.
+  //
+  template <typename sizeN_t>
+  inline bool finish_queries(const u8* s, sizeN_t n, int q_fd, size_t n_q, bool& verified, size_t ram_budget, const char* scratch_dir) {
+    bool ok = sort_by<LcpQuery<sizeN_t>>(q_fd, n_q, [](const LcpQuery<sizeN_t>& q) { return q.a + q.acc; }, ram_budget, scratch_dir);
+
+    ok = ok && ExternalMemory::filter<LcpQuery<sizeN_t>>(q_fd, n_q, [&](LcpQuery<sizeN_t>& q) {
+	// Garbage suffix sorts could take acc past the end
+	q.a_value = q.a + q.acc <= n ? window(s, n, q.a + q.acc) : 0;
+	return true;
+      });
+
+    ok = ok && sort_by<LcpQuery<sizeN_t>>(q_fd, n_q, [](const LcpQuery<sizeN_t>& q) { return q.b + q.acc; }, ram_budget, scratch_dir);
+
+    ok = ok && ExternalMemory::filter<LcpQuery<sizeN_t>>(q_fd, n_q, [&](LcpQuery<sizeN_t>& q) {
+	if (q.a + q.acc > n || q.b + q.acc > n) {
+	  verified = false;
+	  return true;
+	}
+
+	// The search stopped short of INITIAL_H more bytes, so the windows can't match in full
+	if (compare_windows(q, window(s, n, q.b + q.acc), n, verified)) {
+	  verified = false;
+	}
+	return true;
+      });
+
+    return ok;
+  }
+
+  //
+  // Write the lcp array to lcp_fd for the n-entry suffix sort of s in ss_fd.
+  //
+  // @param verified cleared if the suffix sort or lcp failed verification
+  // @return false on I/O error
+  //
+  template <typename sizeN_t>
+  inline bool longest_common_prefixes_external(const u8* s, sizeN_t n, int ss_fd, int lcp_fd, bool& verified, size_t ram_budget, const char* scratch_dir) {
+    int adjacent_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int q_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int hashes_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int plcp_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int done_fd = ExternalMemory::scratch_fd(scratch_dir);
+
+    bool ok = adjacent_fd >= 0 && q_fd >= 0 && hashes_fd >= 0 && plcp_fd >= 0 && done_fd >= 0;
+
+    // Prefix hashes - hashes[i] is the fingerprint of s[0, i)
+    if (ok) {
+      ExternalMemory::Writer<u64> hashes(hashes_fd);
+      u64 hash = 0;
+
+      hashes.put(hash);
+      for (sizeN_t i = 0; i < n; i++) {
+	hash = hash_add(hash_mul(hash, HASH_BASE), s[i]);
+	hashes.put(hash);
+      }
+
+      hashes.flush();
+      ok = hashes.ok;
+    }
+
+    // lcp queries for adjacent suffixes
+    size_t n_q = n-1;
+
+    if (ok) {
+      ExternalMemory::Reader<sizeN_t> ss(ss_fd, 0, n);
+      ExternalMemory::Writer<AdjacentSuffixes<sizeN_t>> out(adjacent_fd);
+
+      sizeN_t first = ss.get();
+      sizeN_t prev = first;
+      for (sizeN_t r = 0; r < n_q; r++) {
+	sizeN_t curr = ss.get();
+	out.put(AdjacentSuffixes<sizeN_t>{prev, curr, r});
+	prev = curr;
+      }
+
+      out.flush();
+      ok = ss.ok && out.ok;
+
+      // The a's and b's are each checked to be distinct and in range - which leaves only this for the
+      //   suffix sort to be a permutation.
+      if (first >= n || (n > 1 && first == prev)) {
+	verified = false;
+      }
+    }
+
+    size_t n_plcp = 0;
+
+    ok = ok && start_queries(s, n, adjacent_fd, q_fd, n_q, hashes_fd, plcp_fd, n_plcp, verified, ram_budget, scratch_dir);
+
+    // Search the queries that match for INITIAL_H bytes or more - they shrink away each round
+    size_t n_done = 0;
+
+    while (ok && n_q != 0) {
+      ok = step_queries(n, q_fd, n_q, hashes_fd, done_fd, n_done, ram_budget, scratch_dir);
+    }
+
+    // Release the query and hash files - everything left is in plcp_fd and done_fd
+    if (adjacent_fd >= 0) {
+      close(adjacent_fd);
+    }
+    if (hashes_fd >= 0) {
+      close(hashes_fd);
+    }
+    if (q_fd >= 0) {
+      close(q_fd);
+    }
+
+    ok = ok && finish_queries(s, n, done_fd, n_done, verified, ram_budget, scratch_dir);
+
+    ok = ok && sort_by<LcpQuery<sizeN_t>>(done_fd, n_done, [](const LcpQuery<sizeN_t>& q) { return q.b; }, ram_budget, scratch_dir);
+
+    // Merge the galloped queries into the rest in string order, resolving the reducible ones, then back into
+    //   suffix sort order - as NamedSuffix with the lcp as name
+    int lcps_fd = ok ? ExternalMemory::scratch_fd(scratch_dir) : -1;
+    ok = ok && lcps_fd >= 0;
+
+    if (ok) {
+      ExternalMemory::Reader<PermutedLcp<sizeN_t>> plcp(plcp_fd, 0, n_plcp, ExternalMemory::stream_buf_len(sizeof(PermutedLcp<sizeN_t>)), /*discard_consumed*/true);
+      ExternalMemory::Reader<LcpQuery<sizeN_t>> done(done_fd, 0, n_done, ExternalMemory::stream_buf_len(sizeof(LcpQuery<sizeN_t>)), /*discard_consumed*/true);
+      ExternalMemory::Writer<NamedSuffix<sizeN_t>> lcps(lcps_fd);
+
+      sizeN_t prev_b = 0;
+      sizeN_t prev_lcp = 0;
+
+      for (size_t k = 0; k < n_plcp + n_done; k++) {
+	PermutedLcp<sizeN_t> x;
+
+	if (plcp.done() || (!done.done() && done.peek().b < plcp.peek().b)) {
+	  LcpQuery<sizeN_t> q = done.get();
+	  x = PermutedLcp<sizeN_t>{q.b, q.r, q.acc};
+	} else {
+	  x = plcp.get();
+	}
+
+	if (x.lcp == PermutedLcp<sizeN_t>::REDUCED) {
+	  // s[a-1] == s[b-1], so the lcp of the previous pair must be at least 1
+	  if (k == 0 || prev_b != x.b-1 || prev_lcp == 0) {
+	    verified = false;
+	    prev_lcp = 1;
+	  }
+	  x.lcp = prev_lcp-1;
+	}
+
+	prev_b = x.b;
+	prev_lcp = x.lcp;
+	lcps.put(NamedSuffix<sizeN_t>{x.lcp, x.r});
+      }
+
+      lcps.flush();
+      ok = plcp.ok && done.ok && lcps.ok;
+    }
+
+    if (done_fd >= 0) {
+      close(done_fd);
+    }
+    if (plcp_fd >= 0) {
+      close(plcp_fd);
+    }
+
+    ok = ok && sort_by<NamedSuffix<sizeN_t>>(lcps_fd, n_plcp + n_done, [](const NamedSuffix<sizeN_t>& x) { return x.i; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Reader<NamedSuffix<sizeN_t>> in(lcps_fd, 0, n_plcp + n_done, ExternalMemory::stream_buf_len(sizeof(NamedSuffix<sizeN_t>)), /*discard_consumed*/true);
+      ExternalMemory::Writer<sizeN_t> lcp(lcp_fd);
+
+      for (size_t k = 0; k < n_plcp + n_done; k++) {
+	lcp.put(in.get().name);
+      }
+      // lcp of the last suffix is 0 by convention
+      lcp.put(0);
+
+      lcp.flush();
+      ok = in.ok && lcp.ok;
+    }
+
+    if (lcps_fd >= 0) {
+      close(lcps_fd);
+    }
+
+    return ok;
+  }
+
+  //
+  // Write the suffix sort of s to ss_fd and the corresponding lcp array to lcp_fd, as raw sizeN_t arrays
+  //   in the same layout as SuffixSort::suffix_sort() and LongestCommonPrefix::longest_common_prefixes().
+  //
+  // Scratch files are created (already unlinked) in scratch_dir.
+  //
+  // @param verified set to whether the suffix sort and lcp passed verification
+  // @return false on I/O error
+  //
+  template <typename sizeN_t>
+  inline bool __attribute__ ((noinline)) suffix_sort_external(const u8* s, sizeN_t n, int ss_fd, int lcp_fd, bool& verified, size_t ram_budget, const char* scratch_dir) {
+    verified = true;
+
+    if (n == 0) {
+      return true;
+    }
+
+    int sort_fd = ExternalMemory::scratch_fd(scratch_dir);
+    int renamed_fd = ExternalMemory::scratch_fd(scratch_dir);
+    // Current names in string order
+    int names_fd = ExternalMemory::scratch_fd(scratch_dir);
+    // Suffixes not yet with a unique name, in string order
+    int active_fd = ExternalMemory::scratch_fd(scratch_dir);
+
+    bool ok = sort_fd >= 0 && renamed_fd >= 0 && names_fd >= 0 && active_fd >= 0;
+
+    size_t n_active = 0;
+
+    // Initial names from windows of s
+    if (ok) {
+      ExternalMemory::Writer<WindowedSuffix<sizeN_t>> out(sort_fd);
+      for (sizeN_t i = 0; i < n; i++) {
+	out.put(WindowedSuffix<sizeN_t>{window(s, n, i), window_len(n, i), i});
+      }
+      out.flush();
+
+      ok = out.ok && ExternalMemory::sort<WindowedSuffix<sizeN_t>>(sort_fd, n, sort_fd, [](const WindowedSuffix<sizeN_t>& x, const WindowedSuffix<sizeN_t>& y) {
+	  return x.window != y.window ? x.window < y.window : x.window_len < y.window_len;
+	}, ram_budget, scratch_dir);
+
+      ok = ok && rename_sorted<sizeN_t, WindowedSuffix<sizeN_t>>(sort_fd, n, renamed_fd, [](const WindowedSuffix<sizeN_t>&) { return (sizeN_t)0; }, [](const WindowedSuffix<sizeN_t>& x, const WindowedSuffix<sizeN_t>& y) {
+	  return x.window == y.window && x.window_len == y.window_len;
+	});
+
+      ok = ok && apply_renames(renamed_fd, n, names_fd, n, active_fd, n_active, /*initial*/true, ram_budget, scratch_dir);
+    }
+
+    // Doubling - only over the suffixes that are not yet unique
+    for (sizeN_t h = INITIAL_H; ok && n_active != 0; h *= 2) {
+      ok = ftruncate(sort_fd, 0) == 0 && ftruncate(renamed_fd, 0) == 0;
+
+      if (ok) {
+	ExternalMemory::Reader<sizeN_t> active(active_fd, 0, n_active);
+	ExternalMemory::Cursor<sizeN_t> names1(names_fd, n);
+	ExternalMemory::Cursor<sizeN_t> names2(names_fd, n);
+	ExternalMemory::Writer<PairedSuffix<sizeN_t>> out(sort_fd);
+
+	for (size_t k = 0; k < n_active; k++) {
+	  sizeN_t i = active.get();
+	  sizeN_t name1 = names1.at(i);
+	  sizeN_t name2 = i+h < n ? names2.at(i+h)+1 : 0;
+	  out.put(PairedSuffix<sizeN_t>{name1, name2, i});
+	}
+
+	out.flush();
+	ok = active.ok && names1.ok && names2.ok && out.ok;
+      }
+
+      ok = ok && ExternalMemory::sort<PairedSuffix<sizeN_t>>(sort_fd, n_active, sort_fd, [](const PairedSuffix<sizeN_t>& x, const PairedSuffix<sizeN_t>& y) {
+	  return x.name1 != y.name1 ? x.name1 < y.name1 : x.name2 < y.name2;
+	}, ram_budget, scratch_dir);
+
+      ok = ok && rename_sorted<sizeN_t, PairedSuffix<sizeN_t>>(sort_fd, n_active, renamed_fd, [](const PairedSuffix<sizeN_t>& x) { return x.name1; }, [](const PairedSuffix<sizeN_t>& x, const PairedSuffix<sizeN_t>& y) {
+	  return x.name1 == y.name1 && x.name2 == y.name2;
+	});
+
+      ok = ok && apply_renames(renamed_fd, n_active, names_fd, n, active_fd, n_active, /*initial*/false, ram_budget, scratch_dir);
+    }
+
+    if (active_fd >= 0) {
+      close(active_fd);
+    }
+    if (renamed_fd >= 0) {
+      close(renamed_fd);
+    }
+
+    // Names are now the suffix ranks - sort by them for the suffix sort
+    ok = ok && ftruncate(sort_fd, 0) == 0;
+
+    if (ok) {
+      ExternalMemory::Reader<sizeN_t> names(names_fd, 0, n);
+      ExternalMemory::Writer<NamedSuffix<sizeN_t>> out(sort_fd);
+
+      for (sizeN_t i = 0; i < n; i++) {
+	out.put(NamedSuffix<sizeN_t>{names.get(), i});
+      }
+
+      out.flush();
+      ok = names.ok && out.ok;
+    }
+
+    if (names_fd >= 0) {
+      close(names_fd);
+    }
+
+    ok = ok && sort_by<NamedSuffix<sizeN_t>>(sort_fd, n, [](const NamedSuffix<sizeN_t>& x) { return x.name; }, ram_budget, scratch_dir);
+
+    if (ok) {
+      ExternalMemory::Reader<NamedSuffix<sizeN_t>> in(sort_fd, 0, n, ExternalMemory::stream_buf_len(sizeof(NamedSuffix<sizeN_t>)), /*discard_consumed*/true);
+      ExternalMemory::Writer<sizeN_t> ss(ss_fd);
+
+      for (sizeN_t r = 0; r < n; r++) {
+	ss.put(in.get().i);
+      }
+
+      ss.flush();
+      ok = in.ok && ss.ok;
+    }
+
+    if (sort_fd >= 0) {
+      close(sort_fd);
+    }
+
+    return ok && longest_common_prefixes_external(s, n, ss_fd, lcp_fd, verified, ram_budget, scratch_dir);
+  }
+
+} // namespace ExternalSuffixSort
+
+#endif //def EXTERNAL_SUFFIX_SORT_HPP
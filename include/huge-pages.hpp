@@ -0,0 +1,79 @@
+#ifndef HUGE_PAGES_HPP
+#define HUGE_PAGES_HPP
+
+#include <cstddef>
+#include <new>
+
+#include <sys/mman.h>
+
+namespace HugePages {
+
+  // MAP_HUGETLB mappings below explicitly ask for this size, rather than the system default hugetlb size,
+  //   so that lengths rounded up to it are always whole huge pages.
+  const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  const int MAP_HUGE_PAGE_SIZE = 21 << MAP_HUGE_SHIFT; // log2(HUGE_PAGE_SIZE) - aka MAP_HUGE_2MB
+#endif
+
+  inline size_t round_up_to_huge_page(size_t len) {
+    return (len + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+  }
+
+  //
+  // Allocate an uninitialised array of n T's, preferably backed by huge pages.
+  //
+  // The large n-sized arrays are accessed randomly (inverse suffix sort, Kasai lcp) so TLB misses
+  //   dominate with 4KB pages once they are much bigger than the TLB reach.
+  //
+  // Tries explicit 2MB huge pages (MAP_HUGETLB) first, which only succeeds if the admin has reserved
+  //   them, then falls back to a regular mapping with a transparent huge page hint.
+  //
+  // Must be released with HugePages::free() with the same n.
+  //
+  template <typename T>
+  inline T* alloc(size_t n) {
+    size_t len = round_up_to_huge_page(n * sizeof(T));
+    if (len == 0) {
+      len = HUGE_PAGE_SIZE;
+    }
+
+    void* p = MAP_FAILED;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_PAGE_SIZE, -1, 0);
+#endif
+
+    if (p == MAP_FAILED) {
+      p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (p == MAP_FAILED) {
+	throw std::bad_alloc();
+      }
+
+#ifdef MADV_HUGEPAGE
+      // Just a hint - ignore failure
+      madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    return (T*) p;
+  }
+
+  template <typename T>
+  inline void free(const T* p, size_t n) {
+    if (p == nullptr) {
+      return;
+    }
+
+    size_t len = round_up_to_huge_page(n * sizeof(T));
+    if (len == 0) {
+      len = HUGE_PAGE_SIZE;
+    }
+
+    munmap((void*) p, len);
+  }
+
+} // namespace HugePages
+
+#endif //def HUGE_PAGES_HPP
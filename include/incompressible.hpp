@@ -0,0 +1,191 @@
+#ifndef INCOMPRESSIBLE_HPP
+#define INCOMPRESSIBLE_HPP
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "int-types.hpp"
+#include "remainder.hpp"
+
+//
+// Cheap detection of incompressible (already compressed or encrypted) blocks, so that they can be stored
+//   raw instead of going through the suffix sort and match finder, which would find almost nothing.
+//
+// Blocks are small, so that a block mixing random data with repeats only loses the random parts. A
+//   random-looking block is still not raw if it repeats - or is repeated by - other random-looking data,
+//   found by probing a sparse table of 8-byte keys from earlier blocks: the copies compress fine, but only
+//   if the source isn't stored raw too.
+//
+namespace Incompressible {
+
+  const size_t BLOCK_LEN = 8*1024;
+
+  // Order-0 entropy at or above this (bits/byte) marks a block as a candidate
+  const double MIN_ENTROPY = 7.5;
+
+  // ... and fewer than 1 in MAX_MATCH_RATE_RECIP probes finding a 4-byte match confirms it
+  const size_t MAX_MATCH_RATE_RECIP = 64;
+
+  const size_t MATCH_TABLE_BITS = 12;
+
+  // Every HISTORY_STRIDE'th position of candidate blocks goes in the table of earlier data, and every
+  //   PROBE_STRIDE'th position is looked up. The strides are coprime, so a repeat of 63 bytes or more is
+  //   always found, with about one hit per HISTORY_STRIDE*PROBE_STRIDE repeated bytes.
+  const size_t HISTORY_STRIDE = 8;
+  const size_t PROBE_STRIDE = 7;
+
+  const size_t HISTORY_TABLE_BITS = 18;
+
+  // Match counts saturate, but only below the threshold matter
+  const size_t MAX_BLOCK_MATCHES = 255;
+  static_assert(BLOCK_LEN / (HISTORY_STRIDE * PROBE_STRIDE) / MAX_MATCH_RATE_RECIP <= MAX_BLOCK_MATCHES, "match counts saturate too early");
+
+  //
+  // @return order-0 entropy of the block in bits/byte
+  //
+  inline double entropy(const u8* p, size_t len) {
+    size_t counts[256] = {};
+    for (size_t i = 0; i < len; i++) {
+      counts[p[i]]++;
+    }
+
+    double bits = 0.0;
+    for (size_t c = 0; c < 256; c++) {
+      if (counts[c] != 0) {
+	double prob = (double)counts[c] / (double)len;
+	bits -= prob * log2(prob);
+      }
+    }
+
+    return bits;
+  }
+
+  //
+  // @return the number of positions in the block whose next 4 bytes were seen earlier in the block
+  //
+  // Earlier positions are remembered in a small lossy hash table, so this undercounts - which is fine
+  //   since a compressible block has plenty of matches to spare.
+  //
+  inline size_t n_matches(const u8* p, size_t len) {
+    u32 table[1 << MATCH_TABLE_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    size_t n = 0;
+
+    for (size_t i = 0; i + 4 <= len; i++) {
+      u32 key;
+      memcpy(&key, &p[i], 4);
+      u32 h = (key * 2654435761U) >> (32 - MATCH_TABLE_BITS);
+
+      u32 prev = table[h];
+      if (prev != 0xffffffff && memcmp(&p[prev], &p[i], 4) == 0) {
+	n++;
+      }
+      table[h] = (u32)i;
+    }
+
+    return n;
+  }
+
+  inline bool is_incompressible(const u8* p, size_t len) {
+    return entropy(p, len) >= MIN_ENTROPY && n_matches(p, len) * MAX_MATCH_RATE_RECIP < len;
+  }
+
+  inline u64 history_key(const u8* p) {
+    u64 key;
+    memcpy(&key, p, 8);
+    return key;
+  }
+
+  inline u64 history_hash(u64 key) {
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - HISTORY_TABLE_BITS);
+  }
+
+  // 32 more bits of the key to tell apart keys with the same hash
+  inline u32 history_check(u64 key) {
+    return (u32)(key ^ (key >> 32));
+  }
+
+  //
+  // Fill raw_ranges with the incompressible BLOCK_LEN blocks of s, adjacent blocks merged, in increasing s_i order.
+  //
+  // Candidates are blocks that look incompressible by themselves. 8-byte matches from a candidate back to
+  //   earlier candidates - found through the sparse history table - are counted against both the block
+  //   they're in and the block they point back to, and either count reaching the same match rate rules a
+  //   candidate out.
+  //
+  // The last (short) block is only considered if it is at least half a block.
+  //
+  template <typename sizeN_t>
+  inline void __attribute__ ((noinline)) find_incompressible_blocks(const u8* s, sizeN_t n, std::vector<Remainder::Range<sizeN_t>>& raw_ranges) {
+    raw_ranges.clear();
+
+    sizeN_t n_blocks = (n + BLOCK_LEN-1) / BLOCK_LEN;
+
+    std::vector<bool> candidates(n_blocks);
+    // Saturating counts of matches into and out of each block
+    std::vector<u8> matches_to(n_blocks);
+    std::vector<u8> matches_from(n_blocks);
+
+    // Earlier positions by hash - just a 32-bit check of the 8-byte key and the block it's in (+1, 0 is
+    //   empty), so that the table stays small and probes don't touch s
+    struct HistoryEntry {
+      u32 check;
+      u32 block_plus_1;
+    };
+    std::vector<HistoryEntry> history(1 << HISTORY_TABLE_BITS, HistoryEntry{0, 0});
+
+    for (sizeN_t block = 0; block < n_blocks; block++) {
+      sizeN_t block_start = block * BLOCK_LEN;
+      sizeN_t block_len = std::min((sizeN_t)BLOCK_LEN, n - block_start);
+
+      candidates[block] = block_len >= BLOCK_LEN/2 && is_incompressible(&s[block_start], block_len);
+
+      if (!candidates[block]) {
+	continue;
+      }
+
+      sizeN_t end = block_start + block_len - 7;
+
+      // Probe against earlier blocks only - repeats within the block are n_matches' job. Probe positions
+      //   stay on their stride across blocks.
+      for (sizeN_t i = (block_start + PROBE_STRIDE-1) / PROBE_STRIDE * PROBE_STRIDE; i < end; i += PROBE_STRIDE) {
+	u64 key = history_key(&s[i]);
+	const HistoryEntry& entry = history[history_hash(key)];
+
+	if (entry.block_plus_1 != 0 && entry.check == history_check(key)) {
+	  u8& to = matches_to[block];
+	  u8& from = matches_from[entry.block_plus_1 - 1];
+	  to += to < MAX_BLOCK_MATCHES;
+	  from += from < MAX_BLOCK_MATCHES;
+	}
+      }
+
+      for (sizeN_t i = block_start; i < end; i += HISTORY_STRIDE) {
+	u64 key = history_key(&s[i]);
+	history[history_hash(key)] = HistoryEntry{history_check(key), (u32)(block + 1)};
+      }
+    }
+
+    for (sizeN_t block = 0; block < n_blocks; block++) {
+      sizeN_t block_start = block * BLOCK_LEN;
+      sizeN_t block_len = std::min((sizeN_t)BLOCK_LEN, n - block_start);
+
+      // Each hit stands for about HISTORY_STRIDE*PROBE_STRIDE repeated bytes
+      size_t hit_len = HISTORY_STRIDE * PROBE_STRIDE;
+      if (!candidates[block] || matches_to[block] * hit_len * MAX_MATCH_RATE_RECIP >= block_len || matches_from[block] * hit_len * MAX_MATCH_RATE_RECIP >= block_len) {
+	continue;
+      }
+
+      if (!raw_ranges.empty() && raw_ranges.back().s_i + raw_ranges.back().len == block_start) {
+	raw_ranges.back().len += block_len;
+      } else {
+	raw_ranges.push_back(Remainder::Range<sizeN_t>{block_start, block_len});
+      }
+    }
+  }
+
+} // namespace Incompressible
+
+#endif //def INCOMPRESSIBLE_HPP
@@ -0,0 +1,251 @@
+#ifndef LONG_RANGE_DEDUP_HPP
+#define LONG_RANGE_DEDUP_HPP
+
+#include <cstring>
+#include <vector>
+
+#include "int-types.hpp"
+#include "util.hpp"
+
+//
+// Long-distance duplicate detection with content-defined chunking.
+//
+// Chunk boundaries are chosen where a rolling (gear) hash of the preceding bytes hits a bit pattern, so
+//   identical content produces identical chunks wherever it occurs in the input. Each chunk is fingerprinted
+//   and a repeated fingerprint is verified and extended into a long match.
+//
+// This finds the same large blob gigabytes apart at a cost of O(N) with a small table, where the
+//   suffix-sort match finder needs several n-sized arrays. The table is flat, 16 bytes per slot for
+//   about two slots per chunk, and can be capped - e.g. to the --external RAM budget - at the cost of
+//   forgetting older chunks. The matches found take another 24 bytes each, one per MIN_CHUNK_LEN bytes at
+//   most.
+//
+namespace LongRangeDedup {
+
+  // Chunk length limits and the average chunk length (a power of 2)
+  const size_t MIN_CHUNK_LEN = 2*1024;
+  const size_t AVG_CHUNK_LEN = 8*1024;
+  const size_t MAX_CHUNK_LEN = 64*1024;
+
+  //
+  // Long match at s_i of len bytes against s[s_i-offset...]
+  //
+  template <typename sizeN_t>
+  struct Match {
+    sizeN_t s_i;
+    sizeN_t offset;
+    sizeN_t len;
+  };
+
+  inline u64 splitmix64(u64& state) {
+    u64 z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  //
+  // Random per-byte values for the gear hash.
+  //
+  struct GearTable {
+    u64 gear[256];
+
+    GearTable() {
+      u64 state = 0x706a6c7a; // "pjlz"
+      for (size_t c = 0; c < 256; c++) {
+	gear[c] = splitmix64(state);
+      }
+    }
+  };
+
+  inline const u64* gear_table() {
+    static const GearTable table;
+    return table.gear;
+  }
+
+  //
+  // @return the end of the chunk starting at chunk_start
+  //
+  // Gear hash: h = (h << 1) + gear[c], so h depends on (at most) the last 64 bytes and its high bits
+  //   depend on the most bytes - hence testing the high bits for a boundary.
+  //
+  template <typename sizeN_t>
+  inline sizeN_t next_chunk_end(const u8* s, sizeN_t n, sizeN_t chunk_start) {
+    const u64* gear = gear_table();
+    const u64 boundary_mask = ~(~(u64)0 >> __builtin_ctzll(AVG_CHUNK_LEN));
+
+    sizeN_t max_end = n - chunk_start > MAX_CHUNK_LEN ? chunk_start + MAX_CHUNK_LEN : n;
+    sizeN_t min_end = n - chunk_start > MIN_CHUNK_LEN ? chunk_start + MIN_CHUNK_LEN : n;
+
+    u64 h = 0;
+    sizeN_t i = chunk_start;
+
+    for (; i < min_end; i++) {
+      h = (h << 1) + gear[s[i]];
+    }
+
+    for (; i < max_end; i++) {
+      if ((h & boundary_mask) == 0) {
+	return i;
+      }
+      h = (h << 1) + gear[s[i]];
+    }
+
+    return max_end;
+  }
+
+  //
+  // 64-bit fingerprint of a chunk - collisions are caught by comparing the chunks.
+  //
+  inline u64 fingerprint(const u8* p, size_t len) {
+    u64 h = len * 0x9e3779b97f4a7c15ULL;
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+      u64 w;
+      memcpy(&w, &p[i], 8);
+      h = (h ^ w) * 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+    }
+    for (; i < len; i++) {
+      h = (h ^ p[i]) * 0xc4ceb9fe1a85ec53ULL;
+    }
+
+    return h ^ (h >> 29);
+  }
+
+  //
+  // Flat open-addressed table from chunk fingerprint to the most recent chunk start with it.
+  //
+  // Lookups probe at most MAX_PROBES slots from the fingerprint's home slot. If neither the fingerprint
+  //   nor an empty slot turns up, the home slot is reused - so an undersized table forgets older chunks
+  //   rather than growing.
+  //
+  template <typename sizeN_t>
+  struct ChunkTable {
+    static const size_t MAX_PROBES = 8;
+
+    struct Entry {
+      // 0 for an empty slot
+      u64 fp;
+      sizeN_t s_i;
+    };
+
+    std::vector<Entry> slots;
+    size_t mask;
+
+    // Enough slots for n_chunks at half load, but no more than fit in max_bytes
+    ChunkTable(size_t n_chunks, size_t max_bytes) {
+      size_t n_slots = 1;
+      while (n_slots < 2*n_chunks && 2*n_slots*sizeof(Entry) <= max_bytes) {
+	n_slots *= 2;
+      }
+      slots.resize(n_slots);
+      mask = n_slots - 1;
+    }
+
+    // Fingerprints are stored as non-zero keys
+    static u64 key(u64 fp) {
+      return fp == 0 ? 1 : fp;
+    }
+
+    //
+    // @return the entry for fp if present, otherwise the slot to store fp in
+    //
+    Entry& slot(u64 fp) {
+      u64 k = key(fp);
+      size_t home = k & mask;
+
+      for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+	Entry& e = slots[(home + probe) & mask];
+	if (e.fp == k || e.fp == 0) {
+	  return e;
+	}
+      }
+
+      return slots[home];
+    }
+  };
+
+  //
+  // Find long-range duplicates in s.
+  //
+  // matches is filled with non-overlapping matches in increasing s_i order, each at least MIN_CHUNK_LEN long
+  //   and maximal - i.e. extended forwards as far as s allows, and backwards up to the previous match.
+  //
+  // Chunks are indexed by fingerprint with the most recent occurrence winning, to keep offsets short. The
+  //   index takes at most max_table_bytes.
+  //
+  // O(N) algo.
+  //
+  template <typename sizeN_t>
+  inline void __attribute__ ((noinline)) find_long_range_matches(const u8* s, sizeN_t n, std::vector<Match<sizeN_t>>& matches, size_t max_table_bytes = ~(size_t)0) {
+    matches.clear();
+
+    ChunkTable<sizeN_t> chunk_s_is(n / AVG_CHUNK_LEN + 1, max_table_bytes);
+
+    // End of the previous match - backwards extension must not overlap it.
+    sizeN_t prev_match_end = 0;
+
+    sizeN_t chunk_start = 0;
+
+    while (chunk_start < n) {
+      sizeN_t chunk_end = next_chunk_end(s, n, chunk_start);
+      sizeN_t chunk_len = chunk_end - chunk_start;
+
+      // Short tail chunk - not worth it
+      if (chunk_len < MIN_CHUNK_LEN) {
+	break;
+      }
+
+      u64 fp = fingerprint(&s[chunk_start], chunk_len);
+      typename ChunkTable<sizeN_t>::Entry& entry = chunk_s_is.slot(fp);
+
+      if (entry.fp == ChunkTable<sizeN_t>::key(fp) && memcmp(&s[entry.s_i], &s[chunk_start], chunk_len) == 0) {
+	sizeN_t match_s_i = chunk_start;
+	sizeN_t src_s_i = entry.s_i;
+
+	while (match_s_i > prev_match_end && src_s_i > 0 && s[match_s_i-1] == s[src_s_i-1]) {
+	  match_s_i--;
+	  src_s_i--;
+	}
+
+	sizeN_t len = chunk_end - match_s_i;
+	len += Util::longest_common_prefix(&s[match_s_i+len], n-match_s_i-len, &s[src_s_i+len], n-src_s_i-len);
+
+	matches.push_back(Match<sizeN_t>{match_s_i, match_s_i - src_s_i, len});
+
+	// Chunking resynchronises by itself after the match since boundaries are content-defined.
+	prev_match_end = match_s_i + len;
+	chunk_start = prev_match_end;
+	continue;
+      }
+
+      entry = typename ChunkTable<sizeN_t>::Entry{ChunkTable<sizeN_t>::key(fp), chunk_start};
+      chunk_start = chunk_end;
+    }
+  }
+
+  //
+  // Fill msm_offsets/msm_lens for the positions covered by matches.
+  //
+  // Positions inside a match get the same offset and the remaining length, which is exactly the maximal
+  //   match at that offset since matches are extended forwards as far as possible. Matches shorter than
+  //   min_match_len at the tail are dropped, as for MaximalSubstringMatch.
+  //
+  template <typename sizeN_t>
+  inline void __attribute__ ((noinline)) expand_matches(const std::vector<Match<sizeN_t>>& matches, sizeN_t* msm_offsets, sizeN_t* msm_lens, sizeN_t min_match_len) {
+    for (const Match<sizeN_t>& m : matches) {
+      for (sizeN_t d = 0; d < m.len; d++) {
+	sizeN_t len = m.len - d;
+	bool is_match = len >= min_match_len;
+
+	msm_offsets[m.s_i + d] = is_match ? m.offset : 0;
+	msm_lens[m.s_i + d] = is_match ? len : 0;
+      }
+    }
+  }
+
+} // namespace LongRangeDedup
+
+#endif //def LONG_RANGE_DEDUP_HPP
@@ -49,7 +49,79 @@ namespace LongestCommonPrefix {
       }
 
       // Next suffix in suffix order
-      int j = ss[rank_i+1];
+      sizeN_t j = ss[rank_i+1];
+
+      // We know already that at least curr_lcp characters match.
+      // Manually find the actual lcp by counting from there.
+      const sizeN_t lcp_limit = std::min(n-i, n-j);
+      for (; curr_lcp < lcp_limit; curr_lcp++) {
+	if (s[i+curr_lcp] != s[j+curr_lcp]) {
+	  break;
+	}
+      }
+
+      lcp[rank_i] = curr_lcp;
+
+      // We're moving to the next string character, so lcp no longer includes this character.
+      if (curr_lcp != 0) {
+	curr_lcp--;
+      }
+    }
+  }
+
+  // Prefetch distances (in text positions) for the two levels of dependent random access in Kasai.
+  // ss[ssi[i]+1] and lcp[ssi[i]] are prefetched furthest ahead; s[ss[ssi[i]+1]] needs ss to have
+  //   arrived already, so it is prefetched closer in.
+  const size_t KASAI_PREFETCH_DISTANCE_SS = 32;
+  const size_t KASAI_PREFETCH_DISTANCE_S = 16;
+
+  //
+  // lcp[i] will contain the longest-common-prefix of ss[i] and ss[i+1].
+  //
+  // Kasai O(N) algo with software prefetch of the random accesses ss[rank_i+1], lcp[rank_i] and s[j].
+  //
+  // Kasai starts comparing s[j...] at the lcp carried over from the previous suffix, which can be well past
+  //   the cache line at s[j] on repetitive input. The lcp D_S suffixes ahead is at least curr_lcp - D_S, so
+  //   that is where s[j] is prefetched.
+  //
+  template <typename sizeN_t>
+  inline void __attribute__ ((noinline)) longest_common_prefixes_kasai_prefetch(const u8* s, const sizeN_t* ss, const sizeN_t* ssi, sizeN_t* lcp, sizeN_t n) {
+
+    const sizeN_t D_SS = KASAI_PREFETCH_DISTANCE_SS;
+    const sizeN_t D_S = KASAI_PREFETCH_DISTANCE_S;
+
+    sizeN_t curr_lcp = 0;
+
+    // Iterate over suffixes s[i..] of the string
+    for (sizeN_t i = 0; i < n; i++) {
+      // Prefetch - note that ss[n] is one past the end, which is harmless for a prefetch.
+      if (i + D_SS < n) {
+	sizeN_t rank_ahead = ssi[i + D_SS];
+	__builtin_prefetch(&ss[rank_ahead+1], /*rw*/0, /*locality*/0);
+	__builtin_prefetch(&lcp[rank_ahead], /*rw*/1, /*locality*/0);
+      }
+      if (i + D_S < n) {
+	sizeN_t rank_ahead = ssi[i + D_S];
+	if (rank_ahead != n-1) {
+	  sizeN_t carried_lcp = curr_lcp > D_S ? curr_lcp - D_S : 0;
+	  sizeN_t j_ahead = ss[rank_ahead+1];
+	  __builtin_prefetch(&s[std::min(j_ahead + carried_lcp, n-1)], /*rw*/0, /*locality*/0);
+	}
+      }
+
+      // Suffix sort rank of the substring
+      sizeN_t rank_i = ssi[i];
+
+      // Highest rank suffix in suffi sort order
+      if (rank_i == n-1) {
+	// No successor in suffix sort order
+	lcp[rank_i] = 0;
+	curr_lcp = 0;
+	continue;
+      }
+
+      // Next suffix in suffix order
+      sizeN_t j = ss[rank_i+1];
 
       // We know already that at least curr_lcp characters match.
       // Manually find the actual lcp by counting from there.
@@ -71,11 +143,14 @@ namespace LongestCommonPrefix {
 
   template <typename sizeN_t>
   inline void longest_common_prefixes(const u8* s, const sizeN_t* ss, const sizeN_t* ssi, sizeN_t* lcp, sizeN_t n) {
-    return longest_common_prefixes_kasai(s, ss, ssi, lcp, n);
+    return longest_common_prefixes_kasai_prefetch(s, ss, ssi, lcp, n);
   }
   
+  //
+  // Naive O(N*LCP) check - recomputes every lcp byte by byte.
+  //
   template <typename sizeN_t>
-  inline bool __attribute__ ((noinline)) check_longest_common_prefixes(const u8* s, const sizeN_t* ss, const sizeN_t* lcp, sizeN_t n) {
+  inline bool __attribute__ ((noinline)) check_longest_common_prefixes_naive(const u8* s, const sizeN_t* ss, const sizeN_t* lcp, sizeN_t n) {
     
     for (sizeN_t i = 0; i < n-1; i++) {
       sizeN_t i1 = ss[i];
@@ -89,7 +164,62 @@ namespace LongestCommonPrefix {
 
     return true;
   }
-  
+
+  //
+  // O(N) check given a correct suffix sort ss and its inverse ssi.
+  //
+  // Visits suffixes in string order, as Kasai does, and relies on the same property of the permuted lcp
+  //   (PLCP): the lcp of s[i..] with its successor in suffix order is at least one less than that of s[i-1..].
+  //   So only the bytes beyond the previous lcp-1 need comparing - O(N) in total - plus the mismatch byte.
+  //
+  template <typename sizeN_t>
+  inline bool __attribute__ ((noinline)) check_longest_common_prefixes_linear(const u8* s, const sizeN_t* ss, const sizeN_t* ssi, const sizeN_t* lcp, sizeN_t n) {
+
+    sizeN_t prev_lcp = 0;
+
+    for (sizeN_t i = 0; i < n; i++) {
+      sizeN_t rank_i = ssi[i];
+      sizeN_t lcp_i = lcp[rank_i];
+
+      // No successor in suffix sort order
+      if (rank_i == n-1) {
+	if (lcp_i != 0) {
+	  return false;
+	}
+	prev_lcp = 0;
+	continue;
+      }
+
+      sizeN_t j = ss[rank_i+1];
+
+      // Already known to match
+      sizeN_t known_lcp = prev_lcp != 0 ? prev_lcp-1 : 0;
+
+      if (lcp_i < known_lcp || lcp_i > std::min(n-i, n-j)) {
+	return false;
+      }
+
+      for (sizeN_t k = known_lcp; k < lcp_i; k++) {
+	if (s[i+k] != s[j+k]) {
+	  return false;
+	}
+      }
+
+      if (i+lcp_i < n && j+lcp_i < n && s[i+lcp_i] == s[j+lcp_i]) {
+	return false;
+      }
+
+      prev_lcp = lcp_i;
+    }
+
+    return true;
+  }
+
+  template <typename sizeN_t>
+  inline bool check_longest_common_prefixes(const u8* s, const sizeN_t* ss, const sizeN_t* ssi, const sizeN_t* lcp, sizeN_t n) {
+    return check_longest_common_prefixes_linear(s, ss, ssi, lcp, n);
+  }
+
 } // namespace LongestPrefixMatch
 
 #endif //def LONGEST_PREFIX_MATCH
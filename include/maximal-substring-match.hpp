@@ -121,8 +121,11 @@ namespace MaximalSubstringMatch {
     delete[] unmatched_s_is;
   }
 
+  //
+  // Naive O(N*LCP) check - recomputes every match length byte by byte.
+  //
   template <typename sizeN_t>
-  inline bool __attribute__ ((noinline)) check_maximal_substring_matches(const u8* s, sizeN_t* msm_offsets, sizeN_t* msm_lens, sizeN_t n, sizeN_t min_match_len) {
+  inline bool __attribute__ ((noinline)) check_maximal_substring_matches_naive(const u8* s, sizeN_t* msm_offsets, sizeN_t* msm_lens, sizeN_t n, sizeN_t min_match_len) {
     
     for (sizeN_t s_i = 0; s_i < n; s_i++) {
 
@@ -155,8 +158,66 @@ namespace MaximalSubstringMatch {
     }
 
     return true;
-  }  
-  
+  }
+
+  //
+  // Sampled check.
+  //
+  // Every match gets O(1) checks - offset/len consistency and a mismatch (or end of string) just past the
+  //   match. A match at the same offset as the match at the previous position must be exactly one shorter,
+  //   which verifies it completely if the previous one was. The first match of each such run is compared
+  //   byte by byte for every sample_stride'th run; with sample_stride 1 the check is exact.
+  //
+  template <typename sizeN_t>
+  inline bool __attribute__ ((noinline)) check_maximal_substring_matches_sampled(const u8* s, const sizeN_t* msm_offsets, const sizeN_t* msm_lens, sizeN_t n, sizeN_t min_match_len, sizeN_t sample_stride) {
+
+    sizeN_t prev_offset = 0;
+    sizeN_t prev_len = 0;
+    sizeN_t n_runs = 0;
+
+    for (sizeN_t s_i = 0; s_i < n; s_i++) {
+
+      sizeN_t msm_offset = msm_offsets[s_i];
+      sizeN_t msm_len = msm_lens[s_i];
+
+      if ((msm_offset == 0) != (msm_len == 0)) {
+	return false;
+      }
+
+      if (msm_offset != 0) {
+	if (msm_len < min_match_len || msm_offset > s_i || msm_len > n-s_i) {
+	  return false;
+	}
+
+	sizeN_t match_s_i = s_i - msm_offset;
+
+	if (s_i+msm_len < n && s[s_i+msm_len] == s[match_s_i+msm_len]) {
+	  return false;
+	}
+
+	if (msm_offset == prev_offset) {
+	  if (msm_len+1 != prev_len) {
+	    return false;
+	  }
+	} else if (n_runs++ % sample_stride == 0) {
+	  if (Util::longest_common_prefix(&s[s_i], msm_len, &s[match_s_i], msm_len) != msm_len) {
+	    return false;
+	  }
+	}
+      }
+
+      prev_offset = msm_offset;
+      prev_len = msm_len;
+    }
+
+    return true;
+  }
+
+  template <typename sizeN_t>
+  inline bool check_maximal_substring_matches(const u8* s, const sizeN_t* msm_offsets, const sizeN_t* msm_lens, sizeN_t n, sizeN_t min_match_len, sizeN_t sample_stride) {
+    return check_maximal_substring_matches_sampled(s, msm_offsets, msm_lens, n, min_match_len, sample_stride);
+  }
+
 } // namespace MaximalSubstringMatch
 
 #endif //def MAXIMAL_SUBSTRING_MATCH
@@ -0,0 +1,171 @@
+#ifndef REMAINDER_HPP
+#define REMAINDER_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "int-types.hpp"
+#include "util.hpp"
+
+//
+// Running the suffix-sort match finder on only part of the input.
+//
+// Ranges of s that are already dealt with (long-range duplicates, raw blocks, ...) are cut out and the rest
+//   is concatenated into a smaller remainder string r. Maximal substring matches found in r are then mapped
+//   back to offsets/lengths in s.
+//
+namespace Remainder {
+
+  //
+  // A range of s that is excluded from the remainder.
+  //
+  template <typename sizeN_t>
+  struct Range {
+    sizeN_t s_i;
+    sizeN_t len;
+  };
+
+  //
+  // A contiguous piece of s at s_i that appears in the remainder at r_i.
+  //
+  template <typename sizeN_t>
+  struct Segment {
+    sizeN_t s_i;
+    sizeN_t r_i;
+    sizeN_t len;
+  };
+
+  //
+  // @return the union of two sorted lists of non-overlapping ranges, sorted and non-overlapping
+  //
+  template <typename sizeN_t>
+  inline std::vector<Range<sizeN_t>> merge_ranges(const std::vector<Range<sizeN_t>>& ranges1, const std::vector<Range<sizeN_t>>& ranges2) {
+    std::vector<Range<sizeN_t>> all(ranges1);
+    all.insert(all.end(), ranges2.begin(), ranges2.end());
+    std::sort(all.begin(), all.end(), [](const Range<sizeN_t>& r1, const Range<sizeN_t>& r2) { return r1.s_i < r2.s_i; });
+
+    std::vector<Range<sizeN_t>> merged;
+    for (const Range<sizeN_t>& r : all) {
+      if (!merged.empty() && r.s_i <= merged.back().s_i + merged.back().len) {
+	merged.back().len = std::max(merged.back().len, r.s_i + r.len - merged.back().s_i);
+      } else {
+	merged.push_back(r);
+      }
+    }
+
+    return merged;
+  }
+
+  //
+  // Copy s without the excluded ranges into r, which must have room for n bytes.
+  //
+  // excluded must be sorted by s_i and non-overlapping.
+  //
+  // @return the remainder length
+  //
+  template <typename sizeN_t>
+  inline sizeN_t __attribute__ ((noinline)) compact(const u8* s, sizeN_t n, const std::vector<Range<sizeN_t>>& excluded, u8* r, std::vector<Segment<sizeN_t>>& segments) {
+    segments.clear();
+
+    sizeN_t s_i = 0;
+    sizeN_t r_i = 0;
+
+    for (size_t k = 0; k <= excluded.size(); k++) {
+      sizeN_t end = k < excluded.size() ? excluded[k].s_i : n;
+
+      if (end > s_i) {
+	sizeN_t len = end - s_i;
+	memcpy(&r[r_i], &s[s_i], len);
+	segments.push_back(Segment<sizeN_t>{s_i, r_i, len});
+	r_i += len;
+      }
+
+      if (k < excluded.size()) {
+	s_i = excluded[k].s_i + excluded[k].len;
+      }
+    }
+
+    return r_i;
+  }
+
+  //
+  // Map remainder maximal substring matches r_msm_offsets/r_msm_lens back to s.
+  //
+  // Only msm_offsets/msm_lens entries at positions covered by segments are written.
+  //
+  // A match in r that runs into the end of either segment may continue (or stop) differently in s, so
+  //   it's clipped at the segment end and re-extended in s. Segment positions are visited backwards so that
+  //   each re-extension can reuse the length found at the next position.
+  //
+  // The segment containing a match source is almost always the one found for the previous position, so the
+  //   binary search over segments is only needed when the source moves to another segment - O(N) plus
+  //   O(log segments) per source segment change.
+  //
+  template <typename sizeN_t>
+  inline void __attribute__ ((noinline)) expand_matches(const u8* s, sizeN_t n, const std::vector<Segment<sizeN_t>>& segments, const sizeN_t* r_msm_offsets, const sizeN_t* r_msm_lens, sizeN_t* msm_offsets, sizeN_t* msm_lens, sizeN_t min_match_len) {
+    // Nothing remains - e.g. the whole input is raw blocks
+    if (segments.empty()) {
+      return;
+    }
+
+    // Segment containing the last match source
+    const Segment<sizeN_t>* match_seg = &segments[0];
+
+    for (const Segment<sizeN_t>& seg : segments) {
+      // Match at the next s position, before min_match_len filtering
+      sizeN_t next_offset = 0;
+      sizeN_t next_len = 0;
+
+      for (sizeN_t d_plus_1 = seg.len; d_plus_1 > 0; --d_plus_1) {
+	sizeN_t d = d_plus_1 - 1;
+	sizeN_t s_i = seg.s_i + d;
+	sizeN_t r_i = seg.r_i + d;
+
+	sizeN_t r_len = r_msm_lens[r_i];
+
+	sizeN_t offset = 0;
+	sizeN_t len = 0;
+
+	if (r_len != 0) {
+	  sizeN_t match_r_i = r_i - r_msm_offsets[r_i];
+
+	  if (match_r_i < match_seg->r_i || match_r_i >= match_seg->r_i + match_seg->len) {
+	    // Segment containing the match source - the last one starting at or before it
+	    auto it = std::upper_bound(segments.begin(), segments.end(), match_r_i, [](sizeN_t r_i, const Segment<sizeN_t>& seg) { return r_i < seg.r_i; });
+	    match_seg = &*(it - 1);
+	  }
+
+	  sizeN_t match_s_i = match_seg->s_i + (match_r_i - match_seg->r_i);
+	  offset = s_i - match_s_i;
+
+	  sizeN_t room = std::min(seg.len - d, match_seg->s_i + match_seg->len - match_s_i);
+
+	  if (r_len < room) {
+	    // Mismatch inside both segments - same in s
+	    len = r_len;
+	  } else if (offset == next_offset && next_len != 0) {
+	    // One more than the (exact) match at the next position
+	    len = next_len + 1;
+	  } else {
+	    len = room + Util::longest_common_prefix(&s[s_i+room], n-s_i-room, &s[match_s_i+room], n-match_s_i-room);
+	  }
+	}
+
+	next_offset = offset;
+	next_len = len;
+
+	if (len < min_match_len) {
+	  offset = 0;
+	  len = 0;
+	}
+
+	msm_offsets[s_i] = offset;
+	msm_lens[s_i] = len;
+      }
+    }
+  }
+
+} // namespace Remainder
+
+#endif //def REMAINDER_HPP
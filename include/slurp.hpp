@@ -7,6 +7,13 @@
 #include <string>
 #include <sstream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "int-types.hpp"
+
 namespace Slurp {
 
   //
@@ -25,6 +32,39 @@ namespace Slurp {
 
     return str;
   }
+
+  //
+  // Map a file read-only, for inputs too big to slurp.
+  //
+  // @return the mapped file contents, or nullptr on failure; len is set to the file length
+  //
+  inline const u8* map_file(const std::string& filepath, size_t& len) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return nullptr;
+    }
+    len = st.st_size;
+
+    // mmap rejects zero length
+    void* p = mmap(nullptr, len == 0 ? 1 : len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED) {
+      return nullptr;
+    }
+
+    return (const u8*) p;
+  }
+
+  inline void unmap_file(const u8* p, size_t len) {
+    munmap((void*) p, len == 0 ? 1 : len);
+  }
   
 } // namespace Slurp
 
@@ -71,8 +71,11 @@ namespace SuffixSort {
     suffix_sort_range(s, n, ss, n);
   }
 
+  //
+  // Naive O(N*LCP) check - compares adjacent suffixes byte by byte.
+  //
   template <typename sizeN_t>
-  inline bool __attribute__ ((noinline)) check_suffix_sort(const u8* s, const sizeN_t* ss, sizeN_t n) {
+  inline bool __attribute__ ((noinline)) check_suffix_sort_naive(const u8* s, const sizeN_t* ss, sizeN_t n) {
     for (sizeN_t i = 0; i < n-1; i++) {
       if (!suffix_less(s, n, ss[i], ss[i+1])) {
 	return false;
@@ -82,16 +85,99 @@ namespace SuffixSort {
     return true;
   }
 
+  //
+  // O(N) check given the inverse suffix sort ssi.
+  //
+  // ss must be a permutation with inverse ssi, and adjacent suffixes must be ordered by first char
+  //   then - if the first chars are equal - by the rank of the suffixes that follow.
+  //
+  template <typename sizeN_t>
+  inline bool __attribute__ ((noinline)) check_suffix_sort_linear(const u8* s, const sizeN_t* ss, const sizeN_t* ssi, sizeN_t n) {
+    for (sizeN_t i = 0; i < n; i++) {
+      if (ss[i] >= n || ssi[ss[i]] != i) {
+	return false;
+      }
+    }
+
+    for (sizeN_t i = 0; i + 1 < n; i++) {
+      sizeN_t i1 = ss[i];
+      sizeN_t i2 = ss[i+1];
+
+      if (s[i1] != s[i2]) {
+	if (s[i1] > s[i2]) {
+	  return false;
+	}
+	continue;
+      }
+
+      // Identical first char - a suffix of length 1 is less than any longer suffix
+      if (i1 == n-1) {
+	continue;
+      }
+      if (i2 == n-1) {
+	return false;
+      }
+
+      if (ssi[i1+1] >= ssi[i2+1]) {
+	return false;
+      }
+    }
+
+    return true;
+  }
+
+  template <typename sizeN_t>
+  inline bool check_suffix_sort(const u8* s, const sizeN_t* ss, const sizeN_t* ssi, sizeN_t n) {
+    return check_suffix_sort_linear(s, ss, ssi, n);
+  }
+
   //
   // Populate ssi with the inverse map of ss.
   //
+  // Naive scatter - one random DRAM access per element once ssi is bigger than LLC.
+  //
   template <typename sizeN_t>
-  inline void __attribute__ ((noinline)) inverse_suffix_sort(const sizeN_t* ss, sizeN_t* ssi, sizeN_t n) {
+  inline void __attribute__ ((noinline)) inverse_suffix_sort_naive(const sizeN_t* ss, sizeN_t* ssi, sizeN_t n) {
     for (sizeN_t i = 0; i < n; i++) {
       ssi[ss[i]] = i;
     }
   }
 
+  // How far ahead (in elements) to prefetch the random scatter targets.
+  // Needs to cover DRAM latency - ~100ns - at a few ns per element.
+  const size_t INVERSE_PREFETCH_DISTANCE = 32;
+
+  //
+  // Populate ssi with the inverse map of ss.
+  //
+  // Same scatter as the naive version but the ssi target cache line is prefetched
+  //   INVERSE_PREFETCH_DISTANCE elements ahead, so that many cache misses are in flight at once.
+  //
+  template <typename sizeN_t>
+  inline void __attribute__ ((noinline)) inverse_suffix_sort_prefetch(const sizeN_t* ss, sizeN_t* ssi, sizeN_t n) {
+    const sizeN_t D = INVERSE_PREFETCH_DISTANCE;
+    sizeN_t i = 0;
+
+    if (n > D) {
+      for (; i < n-D; i++) {
+	__builtin_prefetch(&ssi[ss[i+D]], /*rw*/1, /*locality*/0);
+	ssi[ss[i]] = i;
+      }
+    }
+
+    for (; i < n; i++) {
+      ssi[ss[i]] = i;
+    }
+  }
+
+  //
+  // Populate ssi with the inverse map of ss.
+  //
+  template <typename sizeN_t>
+  inline void inverse_suffix_sort(const sizeN_t* ss, sizeN_t* ssi, sizeN_t n) {
+    return inverse_suffix_sort_prefetch(ss, ssi, n);
+  }
+
   template <typename sizeN_t>
   inline bool __attribute__ ((noinline)) check_inverse_suffix_sort(const sizeN_t* ss, const sizeN_t* ssi, sizeN_t n) {
     for (sizeN_t i = 0; i < n-1; i++) {
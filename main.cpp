@@ -1,10 +1,24 @@
-#include <cassert>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
-
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "external-maximal-substring-match.hpp"
+#include "external-memory.hpp"
+#include "external-suffix-sort.hpp"
+#include "huge-pages.hpp"
+#include "incompressible.hpp"
+#include "long-range-dedup.hpp"
 #include "longest-common-prefix.hpp"
 #include "maximal-substring-match.hpp"
+#include "remainder.hpp"
 #include "slurp.hpp"
 #include "suffix-sort.hpp"
 #include "util.hpp"
@@ -45,101 +59,201 @@ static size_t encoded_len_lz4(size_t val, size_t max_nibble_val) {
   return n_bytes;
 }
 
-int main(int argc, char* argv[]) {
-  
-  if(argc < 2) {
-    fprintf(stderr, "%s <in-file>\n", argv[0]);
+// 7-bit varint encodings of 64-bit values are at most this long
+static const size_t MAX_ENCODED_LEN = 10;
+
+// @return the sum of counts[begin, end)
+static size_t sum(const size_t* counts, size_t begin, size_t end) {
+  size_t total = 0;
+  for (size_t i = begin; i < end; i++) {
+    total += counts[i];
+  }
+  return total;
+}
+
+// Every CHECK_SAMPLE_STRIDE'th item gets a full byte-by-byte check where the checks are sampled.
+static const size_t CHECK_SAMPLE_STRIDE = 16;
+
+//
+// Integrity checks stay on in NDEBUG builds, unlike assert, so they need to be cheap next to what they
+//   check. The in-RAM suffix sort and lcp checks are O(N), though with random access to s and the arrays,
+//   and the external suffix sort and lcp are verified as they are built. The maximal substring match check
+//   is O(N) plus a byte-by-byte compare - O(match length) - of every CHECK_SAMPLE_STRIDE'th run of matches,
+//   or when running externally, sorted joins over every run of matches, so without random access.
+//
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "Check failed: %s\n", what);
+    exit(2);
+  }
+}
+
+//
+// @return a new array of n T's - backed by a scratch file mapping if scratch_dir is non-null, so that it
+//   needn't be resident
+//
+template <typename T>
+static T* alloc_array(const char* scratch_dir, size_t n) {
+  if (scratch_dir == nullptr) {
+    return HugePages::alloc<T>(n);
+  }
+
+  T* p = ExternalMemory::map_scratch<T>(scratch_dir, n);
+  if (p == nullptr) {
+    fprintf(stderr, "Failed to map scratch file in %s\n", scratch_dir);
     exit(1);
   }
 
+  return p;
+}
+
+template <typename T>
+static void free_array(const char* scratch_dir, const T* p, size_t n) {
+  if (scratch_dir == nullptr) {
+    HugePages::free(p, n);
+  } else {
+    ExternalMemory::unmap_scratch(p, n);
+  }
+}
+
+//
+// @return the RAM budget in bytes for a budget argument in MB, or 0 if it isn't a positive whole number
+//
+static size_t parse_ram_budget(const char* arg) {
+  const size_t MB = 1024*1024;
+
+  char* end;
+  errno = 0;
+  unsigned long long budget_mb = strtoull(arg, &end, 10);
+
+  // strtoull quietly accepts leading whitespace and negative numbers
+  if (!isdigit((unsigned char)arg[0]) || *end != '\0' || errno != 0 || budget_mb == 0 || budget_mb > SIZE_MAX/MB) {
+    return 0;
+  }
+
+  return (size_t)budget_mb * MB;
+}
+
+//
+// Suffix sort s, generate the lcp array and find maximal substring matches of min_match_len or longer.
+//
+// The suffix sort and lcp are built in RAM, or externally under ram_budget if scratch_dir is non-null - in
+//   which case they only ever exist in (unlinked) scratch files, as do the match finder's stacks.
+//
+static void find_maximal_substring_matches(const char* name, const u8* s, size_t n, const char* scratch_dir, size_t ram_budget, size_t* msm_offsets, size_t* msm_lens, size_t min_match_len) {
+
   typedef std::chrono::high_resolution_clock Time;
   typedef std::chrono::duration<double> dsec;
-  
+
   auto t0 = Time::now();
-  
-  std::string s_str = Slurp::slurp(argv[1]);
-  const u8* s = (const u8*) s_str.c_str();
-  size_t n = s_str.length();
-  
   auto t1 = Time::now();
-  dsec ds = t1 - t0;
-  double secs = ds.count();
-  
-  printf("Slurped %s length %zu bytes in %.3lf milliseconds\n", argv[1], n, secs*1000.0);
+  dsec ds;
+  double secs;
 
-  t0 = Time::now();
+  bool external = scratch_dir != nullptr;
 
-  size_t* ss = new size_t[n];
+  const size_t* ss = nullptr;
+  const size_t* lcp = nullptr;
+  int ss_fd = -1;
+  int lcp_fd = -1;
 
-  SuffixSort::suffix_sort(s, ss, n);
+  if (external) {
+    t0 = Time::now();
 
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
-  
-  printf("Suffix sorted %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, secs*1000.0, n/secs/1024/1024);
+    ss_fd = ExternalMemory::scratch_fd(scratch_dir);
+    lcp_fd = ExternalMemory::scratch_fd(scratch_dir);
+    if (ss_fd < 0 || lcp_fd < 0) {
+      fprintf(stderr, "Failed to create scratch files in %s\n", scratch_dir);
+      exit(1);
+    }
+
+    bool verified;
+
+    if (!ExternalSuffixSort::suffix_sort_external(s, n, ss_fd, lcp_fd, verified, ram_budget, scratch_dir)) {
+      fprintf(stderr, "Failed writing scratch files in %s\n", scratch_dir);
+      exit(1);
+    }
+
+    check(verified, "suffix sort and longest common prefixes are correct");
+
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
   
-  t0 = Time::now();
+    printf("External suffix sorted, generated and checked ss lcp for %s length %zu bytes with %zu MB RAM budget in %.3lf milliseconds - %.3lf MB/s\n", name, n, ram_budget/1024/1024, secs*1000.0, n/secs/1024/1024);
 
-  assert(SuffixSort::check_suffix_sort(s, ss, n) && "suffix sort is correct");
+  } else {
+    t0 = Time::now();
 
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
+    size_t* ss_ram = HugePages::alloc<size_t>(n);
+
+    SuffixSort::suffix_sort(s, ss_ram, n);
+    ss = ss_ram;
+
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
   
-  printf("Checked suffix sort for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, secs*1000.0, n/secs/1024/1024);
+    printf("Suffix sorted %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", name, n, secs*1000.0, n/secs/1024/1024);
   
-  t0 = Time::now();
+    t0 = Time::now();
 
-  size_t* ssi = new size_t[n];
+    size_t* ssi = HugePages::alloc<size_t>(n);
 
-  SuffixSort::inverse_suffix_sort(ss, ssi, n);
+    SuffixSort::inverse_suffix_sort(ss, ssi, n);
 
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
   
-  printf("Inverse suffix sort of %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, secs*1000.0, n/secs/1024/1024);
+    printf("Inverse suffix sort of %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", name, n, secs*1000.0, n/secs/1024/1024);
   
-  t0 = Time::now();
+    t0 = Time::now();
 
-  assert(SuffixSort::check_inverse_suffix_sort(ss, ssi, n) && "suffix sort is correct");
+    check(SuffixSort::check_suffix_sort(s, ss, (const size_t*)ssi, n), "suffix sort and inverse suffix sort are correct");
 
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
   
-  printf("Checked inverse suffix sort for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, secs*1000.0, n/secs/1024/1024);
+    printf("Checked suffix sort and inverse suffix sort for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", name, n, secs*1000.0, n/secs/1024/1024);
   
-  t0 = Time::now();
+    t0 = Time::now();
 
-  size_t* lcp = new size_t[n];
+    size_t* lcp_ram = HugePages::alloc<size_t>(n);
 
-  LongestCommonPrefix::longest_common_prefixes(s, ss, ssi, lcp, n);
+    LongestCommonPrefix::longest_common_prefixes(s, ss, ssi, lcp_ram, n);
+    lcp = lcp_ram;
 
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
   
-  printf("Generated ss lcp for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, secs*1000.0, n/secs/1024/1024);
+    printf("Generated ss lcp for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", name, n, secs*1000.0, n/secs/1024/1024);
   
-  t0 = Time::now();
+    t0 = Time::now();
 
-  assert(LongestCommonPrefix::check_longest_common_prefixes(s, ss, lcp, n) && "longest common prefixes are correct");
+    check(LongestCommonPrefix::check_longest_common_prefixes(s, ss, (const size_t*)ssi, lcp, n), "longest common prefixes are correct");
 
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
   
-  printf("Checked ss lcp sort for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, secs*1000.0, n/secs/1024/1024);
+    printf("Checked ss lcp sort for %s length %zu bytes in %.3lf milliseconds - %.3lf MB/s\n", name, n, secs*1000.0, n/secs/1024/1024);
+
+    HugePages::free(ssi, n);
+  }
   
   t0 = Time::now();
 
-  size_t* msm_offsets = new size_t[n];
-  size_t* msm_lens = new size_t[n];
-  const size_t MIN_MATCH_LEN = 4;
-  
-  MaximalSubstringMatch::maximal_substring_matches(s, ss, lcp, msm_offsets, msm_lens, n, MIN_MATCH_LEN);
+  if (external) {
+    if (!ExternalMaximalSubstringMatch::maximal_substring_matches(ss_fd, lcp_fd, msm_offsets, msm_lens, n, min_match_len, ram_budget, scratch_dir)) {
+      fprintf(stderr, "Failed writing scratch files in %s\n", scratch_dir);
+      exit(1);
+    }
+  } else {
+    MaximalSubstringMatch::maximal_substring_matches(s, ss, lcp, msm_offsets, msm_lens, n, min_match_len);
+  }
 
   t1 = Time::now();
   ds = t1 - t0;
@@ -147,17 +261,7 @@ int main(int argc, char* argv[]) {
   
   printf("Found maximal substring matches in %.3lf milliseconds - %.3lf MB/s\n", secs*1000.0, n/secs/1024/1024);
 
-  t0 = Time::now();
-
-  assert(MaximalSubstringMatch::check_maximal_substring_matches(s, msm_offsets, msm_lens, n, MIN_MATCH_LEN) && "maximal substring matches are correct");
-
-  t1 = Time::now();
-  ds = t1 - t0;
-  secs = ds.count();
-  
-  printf("Checked maximal substring matches in %.3lf milliseconds - %.3lf MB/s\n", secs*1000.0, n/secs/1024/1024);
-  
-  if (0) {
+  if (0 && !external) {
     size_t prefix_printf_len = 16;
 
     printf("\nSuffixes in sorted order:\n");
@@ -170,7 +274,202 @@ int main(int argc, char* argv[]) {
     }
 
     printf("\n");
-    
+  }
+
+  if (external) {
+    close(lcp_fd);
+    close(ss_fd);
+  } else {
+    HugePages::free(lcp, n);
+    HugePages::free(ss, n);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  
+  bool dedup = false;
+  bool raw_blocks = true;
+  const char* scratch_dir = nullptr;
+  size_t ram_budget = 0;
+
+  bool args_ok = argc >= 2;
+
+  for (int i = 2; args_ok && i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--dedup") {
+      dedup = true;
+    } else if (arg == "--no-raw-blocks") {
+      raw_blocks = false;
+    } else if (arg == "--external" && i+2 < argc) {
+      ram_budget = parse_ram_budget(argv[i+1]);
+      if (ram_budget == 0) {
+	fprintf(stderr, "Invalid RAM budget %s - must be a positive number of MB\n", argv[i+1]);
+	args_ok = false;
+      }
+      scratch_dir = argv[i+2];
+      i += 2;
+    } else {
+      args_ok = false;
+    }
+  }
+
+  if(!args_ok) {
+    fprintf(stderr, "%s <in-file> [--dedup] [--no-raw-blocks] [--external <ram-budget-MB> <scratch-dir>]\n", argv[0]);
+    exit(1);
+  }
+
+  bool external = scratch_dir != nullptr;
+
+  typedef std::chrono::high_resolution_clock Time;
+  typedef std::chrono::duration<double> dsec;
+  
+  auto t0 = Time::now();
+  
+  std::string s_str;
+  const u8* s;
+  size_t n;
+
+  if (external) {
+    // Don't require the input to be resident.
+    s = Slurp::map_file(argv[1], n);
+    if (s == nullptr) {
+      fprintf(stderr, "Failed to map %s\n", argv[1]);
+      exit(1);
+    }
+  } else {
+    s_str = Slurp::slurp(argv[1]);
+    s = (const u8*) s_str.c_str();
+    n = s_str.length();
+  }
+  
+  auto t1 = Time::now();
+  dsec ds = t1 - t0;
+  double secs = ds.count();
+  
+  printf("%s %s length %zu bytes in %.3lf milliseconds\n", external ? "Mapped" : "Slurped", argv[1], n, secs*1000.0);
+
+  size_t* msm_offsets = alloc_array<size_t>(scratch_dir, n);
+  size_t* msm_lens = alloc_array<size_t>(scratch_dir, n);
+  const size_t MIN_MATCH_LEN = 4;
+
+  std::vector<LongRangeDedup::Match<size_t>> dedup_matches;
+  std::vector<Remainder::Range<size_t>> dedup_ranges;
+
+  if (dedup) {
+    t0 = Time::now();
+
+    // The chunk index stays within the RAM budget when running externally
+    LongRangeDedup::find_long_range_matches(s, n, dedup_matches, scratch_dir != nullptr ? ram_budget : ~(size_t)0);
+
+    size_t dedup_len = 0;
+    for (const LongRangeDedup::Match<size_t>& m : dedup_matches) {
+      dedup_ranges.push_back(Remainder::Range<size_t>{m.s_i, m.len});
+      dedup_len += m.len;
+    }
+
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
+
+    printf("Deduplicated %s length %zu bytes - %zu long-range matches covering %zu bytes - in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, dedup_matches.size(), dedup_len, secs*1000.0, n/secs/1024/1024);
+  }
+
+  std::vector<Remainder::Range<size_t>> raw_ranges;
+
+  if (raw_blocks) {
+    t0 = Time::now();
+
+    Incompressible::find_incompressible_blocks(s, n, raw_ranges);
+
+    size_t raw_len = 0;
+    for (const Remainder::Range<size_t>& raw : raw_ranges) {
+      raw_len += raw.len;
+    }
+
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
+
+    printf("Found incompressible blocks in %s length %zu bytes - %zu bytes to be stored raw - in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, raw_len, secs*1000.0, n/secs/1024/1024);
+  }
+
+  // Long-range matches and raw blocks skip the suffix sort pipeline
+  std::vector<Remainder::Range<size_t>> excluded = Remainder::merge_ranges(dedup_ranges, raw_ranges);
+
+  if (excluded.empty()) {
+    find_maximal_substring_matches(argv[1], s, n, scratch_dir, ram_budget, msm_offsets, msm_lens, MIN_MATCH_LEN);
+  } else {
+    t0 = Time::now();
+
+    // Up to n bytes - in a scratch file too when running externally
+    u8* r = alloc_array<u8>(scratch_dir, n);
+    std::vector<Remainder::Segment<size_t>> segments;
+    size_t r_n = Remainder::compact(s, n, excluded, r, segments);
+
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
+
+    printf("Compacted %s length %zu bytes to %zu bytes remaining in %.3lf milliseconds - %.3lf MB/s\n", argv[1], n, r_n, secs*1000.0, n/secs/1024/1024);
+
+    size_t* r_msm_offsets = alloc_array<size_t>(scratch_dir, r_n);
+    size_t* r_msm_lens = alloc_array<size_t>(scratch_dir, r_n);
+
+    std::string r_name = std::string("remainder of ") + argv[1];
+
+    if (r_n != 0) {
+      find_maximal_substring_matches(r_name.c_str(), r, r_n, scratch_dir, ram_budget, r_msm_offsets, r_msm_lens, MIN_MATCH_LEN);
+    }
+
+    t0 = Time::now();
+
+    // Raw blocks are all literals - long-range matches take precedence where they overlap.
+    for (const Remainder::Range<size_t>& raw : raw_ranges) {
+      for (size_t s_i = raw.s_i; s_i < raw.s_i + raw.len; s_i++) {
+	msm_offsets[s_i] = 0;
+	msm_lens[s_i] = 0;
+      }
+    }
+    Remainder::expand_matches(s, n, segments, (const size_t*)r_msm_offsets, (const size_t*)r_msm_lens, msm_offsets, msm_lens, MIN_MATCH_LEN);
+    LongRangeDedup::expand_matches(dedup_matches, msm_offsets, msm_lens, MIN_MATCH_LEN);
+
+    t1 = Time::now();
+    ds = t1 - t0;
+    secs = ds.count();
+
+    printf("Merged long-range, raw block and remainder matches in %.3lf milliseconds - %.3lf MB/s\n", secs*1000.0, n/secs/1024/1024);
+
+    free_array(scratch_dir, r_msm_lens, r_n);
+    free_array(scratch_dir, r_msm_offsets, r_n);
+    free_array(scratch_dir, r, n);
+  }
+
+
+  t0 = Time::now();
+
+  if (scratch_dir != nullptr) {
+    bool verified;
+
+    if (!ExternalMaximalSubstringMatch::check_maximal_substring_matches(s, (const size_t*)msm_offsets, (const size_t*)msm_lens, n, MIN_MATCH_LEN, verified, ram_budget, scratch_dir)) {
+      fprintf(stderr, "Failed writing scratch files in %s\n", scratch_dir);
+      exit(1);
+    }
+
+    check(verified, "maximal substring matches are correct");
+  } else {
+    check(MaximalSubstringMatch::check_maximal_substring_matches(s, (const size_t*)msm_offsets, (const size_t*)msm_lens, n, MIN_MATCH_LEN, CHECK_SAMPLE_STRIDE), "maximal substring matches are correct");
+  }
+
+  t1 = Time::now();
+  ds = t1 - t0;
+  secs = ds.count();
+  
+  printf("Checked maximal substring matches in %.3lf milliseconds - %.3lf MB/s\n", secs*1000.0, n/secs/1024/1024);
+  
+  if (0) {
+    size_t prefix_printf_len = 16;
+
     for (size_t i = 0; i < n; i++) {
       size_t s_i_len = n-i;
 
@@ -194,9 +493,9 @@ int main(int argc, char* argv[]) {
     const size_t MIN_MATCH_LEN = 4;
     
     size_t n_matches = 0;
-    size_t n_match_offsets_of_len[4] = {};
-    size_t n_literal_lengths_of_len[5] = {};
-    size_t n_match_lengths_of_len[5] = {};
+    size_t n_match_offsets_of_len[MAX_ENCODED_LEN] = {};
+    size_t n_literal_lengths_of_len[MAX_ENCODED_LEN+1] = {};
+    size_t n_match_lengths_of_len[MAX_ENCODED_LEN+1] = {};
     size_t total_lit_len = 0;
 
     size_t lit_len = 0;
@@ -246,16 +545,16 @@ int main(int argc, char* argv[]) {
     printf("\n");
     printf("pjlz encoding\n");
     printf("%zu matches / total match-len %zu / total lit-len %zu\n", n_matches, n-total_lit_len, total_lit_len);
-    printf("    offset  encodings:                    1-byte: %6zu / 2-byte: %6zu / 3-byte: %6zu / 4-byte: %6zu\n", n_match_offsets_of_len[0], n_match_offsets_of_len[1], n_match_offsets_of_len[2], n_match_offsets_of_len[3]);
-    printf("    lit-len encodings:   0-byte: %6zu / 1-byte: %6zu / 2-byte: %6zu / 3-byte: %6zu / 4-byte: %6zu\n", n_literal_lengths_of_len[0], n_literal_lengths_of_len[1], n_literal_lengths_of_len[2], n_literal_lengths_of_len[3], n_literal_lengths_of_len[4]);
-    printf("    match-len encodings: 0-byte: %6zu / 1-byte: %6zu / 2-byte: %6zu / 3-byte: %6zu / 4-byte: %6zu\n", n_match_lengths_of_len[0], n_match_lengths_of_len[1], n_match_lengths_of_len[2], n_match_lengths_of_len[3], n_match_lengths_of_len[4]);
+    printf("    offset  encodings:                    1-byte: %6zu / 2-byte: %6zu / 3-byte: %6zu / 4-byte: %6zu / 5+-byte: %6zu\n", n_match_offsets_of_len[0], n_match_offsets_of_len[1], n_match_offsets_of_len[2], n_match_offsets_of_len[3], sum(n_match_offsets_of_len, 4, MAX_ENCODED_LEN));
+    printf("    lit-len encodings:   0-byte: %6zu / 1-byte: %6zu / 2-byte: %6zu / 3-byte: %6zu / 4-byte: %6zu / 5+-byte: %6zu\n", n_literal_lengths_of_len[0], n_literal_lengths_of_len[1], n_literal_lengths_of_len[2], n_literal_lengths_of_len[3], n_literal_lengths_of_len[4], sum(n_literal_lengths_of_len, 5, MAX_ENCODED_LEN+1));
+    printf("    match-len encodings: 0-byte: %6zu / 1-byte: %6zu / 2-byte: %6zu / 3-byte: %6zu / 4-byte: %6zu / 5+-byte: %6zu\n", n_match_lengths_of_len[0], n_match_lengths_of_len[1], n_match_lengths_of_len[2], n_match_lengths_of_len[3], n_match_lengths_of_len[4], sum(n_match_lengths_of_len, 5, MAX_ENCODED_LEN+1));
     printf("\n");
 
     size_t total_encoded_len = total_lit_len + n_matches;
-    for (size_t i = 0; i < 4; i++) {
-      total_encoded_len += n_match_lengths_of_len[i] * (i+1);
+    for (size_t i = 0; i < MAX_ENCODED_LEN; i++) {
+      total_encoded_len += n_match_offsets_of_len[i] * (i+1);
     }
-    for (size_t i = 0; i < 5; i++) {
+    for (size_t i = 0; i <= MAX_ENCODED_LEN; i++) {
       total_encoded_len += n_literal_lengths_of_len[i] * i;
       total_encoded_len += n_match_lengths_of_len[i] * i;
     }